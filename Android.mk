@@ -2,7 +2,14 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_C_INCLUDES:= $(LOCAL_PATH)/include
-LOCAL_SRC_FILES:= src/lib/compress.c src/lib/compress_hw.c
+LOCAL_SRC_FILES:= src/lib/compress.c src/lib/compress_hw.c src/lib/compress_enum.c \
+	src/lib/compress_cache.c src/lib/compress_metrics.c
+# like --enable-builtin-plugins, for static or embedded builds
+ifeq ($(TINYCOMPRESS_BUILTIN_PLUGINS),true)
+LOCAL_SRC_FILES += src/lib/compress_builtin.c src/plugins/tee/tee.c \
+	src/plugins/shm/shm.c
+LOCAL_CFLAGS := -DCOMPRESS_PLUGIN_BUILTIN
+endif
 LOCAL_MODULE := libtinycompress
 LOCAL_SHARED_LIBRARIES:= libcutils libutils
 LOCAL_MODULE_TAGS := optional
@@ -8,7 +8,27 @@
 #include "sound/compress_offload.h"
 #include "tinycompress.h"
 
+#include <stddef.h>
+#include <sys/uio.h>
+
 #define COMPRESS_OPS_V2		0xadcc0002	/* version 2 magic */
+#define COMPRESS_OPS_V3		0xadcc0003	/* version 3 magic */
+
+/*
+ * Feature bits advertised in compress_ops.features by V3 plugins.
+ * Each bit announces that the matching extension op is implemented;
+ * the core falls back to the generic V2 ops when a bit is clear.
+ */
+#define COMPRESS_OPS_F_WRITEV		(1 << 0)	/* writev */
+#define COMPRESS_OPS_F_POLL_FD		(1 << 1)	/* get_poll_fd */
+#define COMPRESS_OPS_F_CAPS		(1 << 2)	/* get_caps */
+#define COMPRESS_OPS_F_QUEUE_NEXT_TRACK	(1 << 3)	/* queue_next_track */
+#define COMPRESS_OPS_F_READBACK		(1 << 4)	/* get_metadata, get_codec_params */
+#define COMPRESS_OPS_F_ADAPTIVE_POLL	(1 << 5)	/* set_adaptive_poll */
+#define COMPRESS_OPS_F_SNAPSHOT		(1 << 6)	/* get_snapshot */
+#define COMPRESS_OPS_F_RECONFIGURE	(1 << 7)	/* reconfigure */
+#define COMPRESS_OPS_F_STATS		(1 << 8)	/* get_stats */
+#define COMPRESS_OPS_F_LOW_WATERMARK	(1 << 9)	/* set_low_watermark */
 
 /*
  * struct compress_ops:
@@ -46,6 +66,82 @@ struct compress_ops {
 	int (*is_compress_ready)(void *compress_data);
 	const char *(*get_error)(void *compress_data);
 	int (*set_codec_params)(void *compress_data, struct snd_codec *codec);
+
+	/*
+	 * V3 extension, only valid when magic is COMPRESS_OPS_V3.
+	 * @size must be set to sizeof(struct compress_ops) as seen by the
+	 * plugin so that the layout can keep growing at the end.
+	 */
+	unsigned int size;
+	unsigned int features;
+	int (*writev)(void *compress_data, const struct iovec *iov, int iovcnt);
+	int (*get_poll_fd)(void *compress_data);
+	int (*get_caps)(void *compress_data, struct snd_compr_caps *caps);
+	int (*queue_next_track)(void *compress_data, struct snd_codec *codec,
+			struct compr_gapless_mdata *mdata);
+	int (*get_metadata)(void *compress_data, struct compr_gapless_mdata *mdata);
+	int (*get_codec_params)(void *compress_data, struct snd_codec *codec);
+	int (*set_adaptive_poll)(void *compress_data, int enable);
+	int (*get_snapshot)(void *compress_data,
+			struct compress_snapshot *snapshot);
+	int (*reconfigure)(void *compress_data, struct compr_config *config);
+	/* fills only the counters kept by the backend, see compress_stats */
+	int (*get_stats)(void *compress_data, struct compress_stats *stats);
+	int (*set_low_watermark)(void *compress_data, unsigned int threshold_us,
+			void (*notify)(void *arg, unsigned long long queued_us),
+			void *arg);
 };
 
+/*
+ * struct compress_plugin: a plugin linked into libtinycompress or the
+ * application rather than loaded from TINYCOMPRESS_PLUGIN_DIR.
+ * '<name>:' prefixes are looked up among the registered plugins before
+ * the plugin directory is searched.
+ */
+struct compress_plugin {
+	const char *name;
+	struct compress_ops *ops;
+	struct compress_plugin *next;
+};
+
+void compress_plugin_register(struct compress_plugin *plugin);
+
+/*
+ * COMPRESS_PLUGIN_DEFINE: declare @plugin_ops as the ops of plugin @plugin
+ * Built with COMPRESS_PLUGIN_BUILTIN defined, the plugin registers itself
+ * when the object it lives in is loaded, and compress_plugin_@plugin can be
+ * listed in a table the linker cannot drop, like the one of the plugins
+ * bundled with libtinycompress. It is hidden, so a shared library does
+ * not export it. Otherwise @plugin_ops is exported as
+ * compress_plugin_mops for the dlopen() loader.
+ */
+#ifdef COMPRESS_PLUGIN_BUILTIN
+#define COMPRESS_PLUGIN_DEFINE(plugin, plugin_ops)			\
+	extern struct compress_plugin compress_plugin_##plugin		\
+		__attribute__((visibility("hidden")));			\
+	static void __attribute__((constructor))			\
+	compress_plugin_register_##plugin(void)				\
+	{								\
+		compress_plugin_register(&compress_plugin_##plugin);	\
+	}								\
+	struct compress_plugin compress_plugin_##plugin = {		\
+		.name = #plugin,					\
+		.ops = &(plugin_ops),					\
+	}
+#else
+#define COMPRESS_PLUGIN_DEFINE(plugin, plugin_ops)			\
+	extern struct compress_ops compress_plugin_mops			\
+		__attribute__((alias(#plugin_ops)))
+#endif
+
+/*
+ * COMPRESS_OPS_HAS: true when @ops is a V3 table which is large enough
+ * to contain @op and advertises @feature for it.
+ */
+#define COMPRESS_OPS_HAS(ops, op, feature)				\
+	((ops)->magic == COMPRESS_OPS_V3 &&				\
+	 (ops)->size >= offsetof(struct compress_ops, op) +		\
+			sizeof((ops)->op) &&				\
+	 ((ops)->features & (feature)) && (ops)->op)
+
 #endif /* end of __COMPRESS_OPS_H__ */
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Wire protocol shared by the shm plugin and the cshmd host daemon.
+ *
+ * The client connects to the host's SOCK_SEQPACKET UNIX socket and
+ * sends one struct compress_shm_req per control op, the host answers
+ * each with one struct compress_shm_resp. The reply to
+ * COMPRESS_SHM_OPEN carries three descriptors (SCM_RIGHTS): a memfd
+ * holding the data ring and two eventfds, one kicked by the producer
+ * when data was queued and one kicked by the consumer when space was
+ * released. Stream data never crosses the socket.
+ */
+
+#ifndef __COMPRESS_SHM_H__
+#define __COMPRESS_SHM_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "sound/compress_params.h"
+#include "tinycompress/tinycompress.h"
+
+#define COMPRESS_SHM_MAGIC	0x4d485343	/* "CSHM" */
+#define COMPRESS_SHM_ERR_MAX	128
+
+enum compress_shm_cmd {
+	COMPRESS_SHM_OPEN = 1,
+	COMPRESS_SHM_CLOSE,
+	COMPRESS_SHM_START,
+	COMPRESS_SHM_STOP,
+	COMPRESS_SHM_PAUSE,
+	COMPRESS_SHM_RESUME,
+	COMPRESS_SHM_DRAIN,
+	COMPRESS_SHM_PARTIAL_DRAIN,
+	COMPRESS_SHM_NEXT_TRACK,
+	COMPRESS_SHM_SET_GAPLESS_METADATA,
+	COMPRESS_SHM_SET_CODEC_PARAMS,
+	COMPRESS_SHM_GET_HPOINTER,
+	COMPRESS_SHM_GET_TSTAMP,
+	COMPRESS_SHM_IS_CODEC_SUPPORTED,
+};
+
+/* indices of the descriptors passed with the COMPRESS_SHM_OPEN reply */
+enum {
+	COMPRESS_SHM_FD_RING,
+	COMPRESS_SHM_FD_DATA,		/* producer -> consumer */
+	COMPRESS_SHM_FD_SPACE,		/* consumer -> producer */
+	COMPRESS_SHM_NUM_FDS,
+};
+
+/*
+ * Data ring placed at the start of the memfd. head and tail are free
+ * running byte counters; the producer only writes head and the consumer
+ * only writes tail. The mapping is shared with an untrusted peer, so
+ * both sides pass their own copy of the ring size to the helpers below
+ * instead of trusting the size field.
+ */
+struct compress_shm_ring {
+	uint32_t magic;
+	uint32_t size;			/* bytes in data[], power of two */
+	_Alignas(64) _Atomic uint64_t head;
+	_Alignas(64) _Atomic uint64_t tail;
+	_Alignas(64) char data[];
+};
+
+struct compress_shm_req {
+	uint32_t cmd;
+	union {
+		struct {
+			uint32_t flags;
+			uint32_t fragment_size;
+			uint32_t fragments;
+			struct snd_codec codec;
+		} open;
+		struct compr_gapless_mdata mdata;
+		struct snd_codec codec;
+	};
+};
+
+struct compress_shm_resp {
+	int32_t ret;
+	int32_t err;			/* errno when ret < 0 */
+	union {
+		struct {
+			uint32_t fragment_size;
+			uint32_t fragments;
+			uint32_t ring_size;
+		} open;
+		struct {
+			uint64_t avail;
+			int64_t tv_sec;
+			int64_t tv_nsec;
+		} hpointer;
+		struct {
+			uint64_t samples;
+			uint32_t sampling_rate;
+		} tstamp;
+	};
+	char error[COMPRESS_SHM_ERR_MAX];
+};
+
+/* contiguous bytes readable at *ptr, consumer side */
+static inline uint32_t compress_shm_ring_peek(struct compress_shm_ring *ring,
+		uint32_t size, char **ptr)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t off = tail & (size - 1);
+	uint64_t len = head - tail;
+
+	if (len > size - off)
+		len = size - off;
+	*ptr = ring->data + off;
+	return len;
+}
+
+static inline void compress_shm_ring_consume(struct compress_shm_ring *ring,
+		uint32_t len)
+{
+	atomic_fetch_add_explicit(&ring->tail, len, memory_order_release);
+}
+
+/* contiguous bytes writable at *ptr, producer side */
+static inline uint32_t compress_shm_ring_reserve(struct compress_shm_ring *ring,
+		uint32_t size, char **ptr)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	uint32_t off = head & (size - 1);
+	uint64_t len = size - (head - tail);
+
+	if (len > size - off)
+		len = size - off;
+	*ptr = ring->data + off;
+	return len;
+}
+
+static inline void compress_shm_ring_commit(struct compress_shm_ring *ring,
+		uint32_t len)
+{
+	atomic_fetch_add_explicit(&ring->head, len, memory_order_release);
+}
+
+static inline uint64_t compress_shm_ring_used(struct compress_shm_ring *ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire) -
+	       atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif /* end of __COMPRESS_SHM_H__ */
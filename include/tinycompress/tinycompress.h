@@ -58,6 +58,8 @@
 
 #include <linux/types.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #if defined(__cplusplus)
 extern "C" {
@@ -85,8 +87,119 @@ struct compr_gapless_mdata {
 #define COMPRESS_OUT        0x20000000
 #define COMPRESS_IN         0x10000000
 
+/*
+ * struct compress_media_clock: DSP clock estimate against CLOCK_MONOTONIC
+ *
+ * @mono_ns: CLOCK_MONOTONIC time the estimate refers to
+ * @media_ns: drift corrected media time at mono_ns
+ * @rate_ratio: media time elapsed per unit of monotonic time
+ * @points: number of hw timestamps the estimate is based on
+ */
+struct compress_media_clock {
+	unsigned long long mono_ns;
+	unsigned long long media_ns;
+	double rate_ratio;
+	unsigned int points;
+};
+
+/*
+ * struct compress_snapshot: buffer and timestamp state from one query
+ *
+ * @avail: buffer available for write/read, in bytes
+ * @byte_offset: offset of the DSP in the ring buffer, in bytes
+ * @copied_total: total bytes copied to/from the DSP
+ * @pcm_frames: frames decoded or encoded by the DSP
+ * @pcm_io_frames: frames rendered or received by the DSP
+ * @sampling_rate: sampling rate of the pcm frames
+ * @mono: CLOCK_MONOTONIC time of the query
+ */
+struct compress_snapshot {
+	unsigned long long avail;
+	unsigned int byte_offset;
+	unsigned long long copied_total;
+	unsigned long long pcm_frames;
+	unsigned long long pcm_io_frames;
+	unsigned int sampling_rate;
+	struct timespec mono;
+};
+
+/*
+ * struct compress_startup_latency: time to first audio of a stream
+ *
+ * @prefill_ns: from the first write until the stream was started
+ * @start_ns: from the start until the first sample was rendered
+ * @total_ns: from the first write until the first sample was rendered
+ * @prefill_bytes: bytes written before the stream was started, only
+ *	counted when a start threshold is set
+ */
+struct compress_startup_latency {
+	unsigned long long prefill_ns;
+	unsigned long long start_ns;
+	unsigned long long total_ns;
+	unsigned long long prefill_bytes;
+};
+
+/*
+ * struct compress_stats: counters of a stream since it was opened
+ *
+ * @bytes: bytes written to or read from the stream
+ * @transfers: compress_write(), compress_writev() and compress_read() calls
+ * @partial_transfers: transfers which moved fewer bytes than asked
+ * @errors: calls of the stream which failed
+ * @poll_timeouts: waits for buffer space or data which timed out
+ * @underrun_risk: playback writes which found less audio queued in the
+ *	device buffer than the low watermark, see
+ *	compress_set_low_watermark()
+ * @drains: completed compress_drain() and compress_partial_drain() calls
+ * @drain_ns: time spent in them
+ * @drain_max_ns: longest of them
+ */
+struct compress_stats {
+	unsigned long long bytes;
+	unsigned long long transfers;
+	unsigned long long partial_transfers;
+	unsigned long long errors;
+	unsigned long long poll_timeouts;
+	unsigned long long underrun_risk;
+	unsigned long long drains;
+	unsigned long long drain_ns;
+	unsigned long long drain_max_ns;
+};
+
+#define COMPRESS_ENUM_MAX_CODECS	32
+
+/*
+ * struct compress_device_info: a compress node found by compress_enumerate()
+ *
+ * @card: sound card number
+ * @device: device number
+ * @direction: SND_COMPRESS_PLAYBACK, SND_COMPRESS_CAPTURE, ...
+ * @min_fragment_size, @max_fragment_size: fragment size range, in bytes
+ * @min_fragments, @max_fragments: fragment count range
+ * @num_codecs: number of entries in @codecs
+ * @codecs: supported codec IDs
+ * @error: 0, or negative errno if the node could not be probed (for
+ *	example because it is busy), the caps are then all zero
+ */
+struct compress_device_info {
+	__u32 card;
+	__u32 device;
+	__u32 direction;
+	__u32 min_fragment_size;
+	__u32 max_fragment_size;
+	__u32 min_fragments;
+	__u32 max_fragments;
+	__u32 num_codecs;
+	__u32 codecs[COMPRESS_ENUM_MAX_CODECS];
+	int error;
+};
+
+#define COMPRESS_ENUM_RESCAN	0x1
+
 struct compress;
+struct compress_preopen;
 struct snd_compr_tstamp;
+struct snd_compr_caps;
 
 /*
  * compress_open: open a new compress stream
@@ -120,6 +233,42 @@ struct compress *compress_open(unsigned int card, unsigned int device,
 
 struct compress *compress_open_by_name(const char *name,
 		unsigned int flags, struct compr_config *config);
+/*
+ * compress_open_any: open the best free hw node for a codec
+ * The enumerated nodes matching the direction, codec and, if given,
+ * fragment config are tried in order of fit, nodes offering fewer
+ * codecs first. Nodes already opened by this process are skipped, and
+ * nodes another process holds are passed over.
+ * returns the valid struct compress on success, NULL on failure with
+ * errno set to ENODEV when no node fits or EBUSY when all were in use
+ *
+ * @flags: device flags can be COMPRESS_OUT or COMPRESS_IN
+ * @config: stream config requested, config->codec selects the node.
+ *	Returns actual fragment config
+ * @card: if not NULL, returns the card number of the opened node
+ * @device: if not NULL, returns the device number of the opened node
+ */
+struct compress *compress_open_any(unsigned int flags,
+		struct compr_config *config, unsigned int *card,
+		unsigned int *device);
+
+/*
+ * compress_enumerate: list the compress nodes of the system
+ * All /dev/snd/comprC*D* nodes are probed for their direction and caps
+ * in parallel. The table is cached and only probed again when /dev/snd
+ * changed or COMPRESS_ENUM_RESCAN is passed; nodes which were busy are
+ * probed again on every call. When TINYCOMPRESS_CACHE_DIR
+ * names a writable directory the caps are also kept there, so a new
+ * process need not open the nodes again as long as the kernel, the card
+ * driver and the node are unchanged.
+ * returns the number of devices on success, negative on error
+ *
+ * @devices: returns a table sorted by card and device, to be released
+ *	with free(), NULL when no device was found
+ * @flags: 0 or COMPRESS_ENUM_RESCAN
+ */
+int compress_enumerate(struct compress_device_info **devices, unsigned int flags);
+
 /*
  * compress_close: close the compress stream
  *
@@ -175,6 +324,60 @@ int compress_get_tstamp(struct compress *compress,
 int compress_get_tstamp64(struct compress *compress,
 		unsigned long long *samples, unsigned int *sampling_rate);
 
+/*
+ * compress_get_snapshot: get avail and the full hw timestamp at once
+ * Both come from a single query, so they describe the same instant.
+ * Backends without a combined query fall back to separate hpointer and
+ * tstamp queries, leaving byte_offset, copied_total and pcm_frames zero.
+ * return 0 on success, negative on error
+ *
+ * @compress: compress stream on which query is made
+ * @snapshot: returns the buffer and timestamp state
+ */
+int compress_get_snapshot(struct compress *compress,
+		struct compress_snapshot *snapshot);
+
+/*
+ * compress_get_position: get the interpolated playback position
+ * The hw timestamp is queried at most once per position interval, in
+ * between the position is extrapolated from the last snapshot using
+ * CLOCK_MONOTONIC and the sampling rate. The returned position never
+ * goes backwards while the stream keeps running.
+ * return 0 on success, negative on error
+ *
+ * @compress: compress stream on which query is made
+ * @samples: number of decoded samples played
+ * @sampling_rate: sampling rate of decoded samples
+ */
+int compress_get_position(struct compress *compress,
+		unsigned long long *samples, unsigned int *sampling_rate);
+
+/*
+ * compress_set_position_interval: set how often compress_get_position()
+ * takes a new hw snapshot, default is 100ms. Zero queries the hw on
+ * every call.
+ *
+ * @compress: compress stream to be configured
+ * @milliseconds: snapshot interval
+ */
+void compress_set_position_interval(struct compress *compress, int milliseconds);
+
+/*
+ * compress_get_media_clock: estimate the DSP clock against the system clock
+ * Every hw timestamp query made through the library while the stream is
+ * running is paired with CLOCK_MONOTONIC, a line fitted through the
+ * recent pairs gives the rate ratio and a drift corrected media time.
+ * A new hw timestamp is only taken when the newest pair is older than
+ * the position interval. Pairs are discarded on stream state changes.
+ * return 0 on success, negative on error
+ * returns -EAGAIN until enough pairs have been collected
+ *
+ * @compress: compress stream on which query is made
+ * @mclock: returns the clock estimate
+ */
+int compress_get_media_clock(struct compress *compress,
+		struct compress_media_clock *mclock);
+
 /*
  * compress_write: write data to the compress stream
  * return bytes written on success, negative on error
@@ -194,6 +397,47 @@ int compress_get_tstamp64(struct compress *compress,
  */
 int compress_write(struct compress *compress, const void *buf, unsigned int size);
 
+/*
+ * compress_writev: gather data from several buffers into the stream
+ * return bytes written on success, negative on error
+ * Behaves like compress_write() on the concatenation of @iov. Plugins
+ * which implement a vectored write get a single call, others are fed
+ * one compress_write() per segment.
+ *
+ * @compress: compress stream to be written to
+ * @iov: array of buffers
+ * @iovcnt: number of entries in @iov
+ */
+int compress_writev(struct compress *compress, const struct iovec *iov, int iovcnt);
+
+/*
+ * compress_set_write_staging: coalesce small writes into whole fragments
+ * When enabled, compress_write() copies data smaller than a fragment into
+ * a per stream buffer and only writes to the device once a full
+ * fragment is collected. Staged data is flushed by compress_start(),
+ * compress_drain(), compress_partial_drain(), compress_next_track(),
+ * compress_queue_next_track() and compress_flush(), and discarded by
+ * compress_stop(). The drain and next track calls fail with -EAGAIN if
+ * it cannot all be written. It is not yet counted in avail or in the
+ * timestamps. Playback streams only.
+ * return 0 on success, negative on error
+ * returns -EAGAIN when disabling while staged data could not be flushed
+ *
+ * @compress: compress stream to be configured
+ * @enable: non-zero to enable, zero to flush and disable
+ */
+int compress_set_write_staging(struct compress *compress, int enable);
+
+/*
+ * compress_flush: write out the data held in the staging buffer
+ * Blocks like compress_write() unless non-blocking mode is enabled.
+ * returns the number of bytes still staged, zero when all were written,
+ * negative on error
+ *
+ * @compress: compress stream to be flushed
+ */
+int compress_flush(struct compress *compress);
+
 /*
  * compress_read: read data from the compress stream
  * return bytes read on success, negative on error
@@ -219,6 +463,51 @@ int compress_read(struct compress *compress, void *buf, unsigned int size);
  */
 int compress_start(struct compress *compress);
 
+/*
+ * compress_set_start_threshold: start playback after a partial prefill
+ * With a non zero threshold compress_write() starts the stream by itself
+ * as soon as that many bytes are buffered, and keeps writing the rest of
+ * the data while the DSP already plays. A later compress_start() from
+ * the caller then succeeds without doing anything. If the automatic
+ * start fails, the threshold is cleared and the error is reported by
+ * the caller's compress_start(). The threshold is kept across
+ * compress_stop().
+ *
+ * @compress: compress stream to be configured
+ * @bytes: bytes to prefill before starting, zero disables fast start
+ */
+void compress_set_start_threshold(struct compress *compress, unsigned int bytes);
+
+/*
+ * compress_get_startup_latency: report how long the stream took to start
+ * return 0 on success, negative on error
+ * returns -EAGAIN if the stream was not started or did not render a
+ * sample yet
+ *
+ * @compress: compress stream on which query is made
+ * @latency: returns the startup timings
+ */
+int compress_get_startup_latency(struct compress *compress,
+		struct compress_startup_latency *latency);
+
+/*
+ * compress_start_group: start several streams as close together as possible
+ * The streams are triggered back to back from the calling thread, which
+ * is pinned to its current CPU and raised to SCHED_FIFO for the duration
+ * when permitted. No data is written here: every stream must already
+ * be prefilled by the caller, as for compress_start(). If a start fails
+ * the streams already started are stopped again.
+ * return 0 on success, negative on error
+ *
+ * @streams: streams to be started
+ * @count: number of streams
+ * @skew_ns: if not NULL, returns the spread of the rendering start times
+ *	estimated from the first timestamps, or the time spent triggering
+ *	when a stream did not report progress within 200ms
+ */
+int compress_start_group(struct compress **streams, unsigned int count,
+		unsigned long long *skew_ns);
+
 /*
  * compress_stop: stop the compress stream
  * return 0 on success, negative on error
@@ -271,6 +560,54 @@ int compress_next_track(struct compress *compress);
  */
 int compress_partial_drain(struct compress *compress);
 
+/*
+ * compress_drain_async: drain the stream in the background
+ * compress_drain(), or compress_partial_drain() when @partial is set,
+ * runs in a helper thread and the call returns right away. When the
+ * drain returned, the descriptor returned here becomes readable and
+ * then @cb, if not NULL, is called from the helper thread. Either way
+ * the drain has to be reaped with compress_drain_wait(), which must not
+ * be called from @cb. Until then the stream may only be stopped, which
+ * also ends the drain, or closed.
+ * returns a descriptor to poll for POLLIN, owned by the stream, or
+ * negative on error
+ * returns -EBUSY when a drain is already pending
+ *
+ * @compress: compress stream to be drained
+ * @partial: non-zero for a partial drain
+ * @cb: called with the result of the drain, may be NULL
+ * @arg: passed to @cb
+ */
+int compress_drain_async(struct compress *compress, int partial,
+		void (*cb)(struct compress *compress, int ret, void *arg),
+		void *arg);
+
+/*
+ * compress_drain_wait: wait for a drain started by compress_drain_async()
+ * return the result of the drain, 0 on success, negative on error
+ * returns -ETIMEDOUT when the drain did not finish in time, it is then
+ * still pending and can be waited for again
+ * returns -EINVAL when no drain is pending
+ *
+ * @compress: compress stream being drained
+ * @timeout_ms: longest time to wait, -1 to wait until done, 0 to poll
+ */
+int compress_drain_wait(struct compress *compress, int timeout_ms);
+
+/*
+ * compress_drain_timeout: drain the stream, waiting at most @timeout_ms
+ * A drain still running after the timeout keeps going in the background
+ * like one started with compress_drain_async(): call this again or
+ * compress_drain_wait() to go on waiting, or compress_stop() to cut it
+ * short and then reap it.
+ * return 0 on success, negative on error
+ * returns -ETIMEDOUT when the drain did not finish in time
+ *
+ * @compress: compress stream to be drained
+ * @timeout_ms: longest time to wait, -1 to wait until done
+ */
+int compress_drain_timeout(struct compress *compress, int timeout_ms);
+
 /*
  * compress_set_gapless_metadata: set gapless metadata of a compress strem
  *
@@ -283,6 +620,49 @@ int compress_partial_drain(struct compress *compress);
 int compress_set_gapless_metadata(struct compress *compress,
 			struct compr_gapless_mdata *mdata);
 
+/*
+ * compress_queue_next_track: arm the next track of a gapless stream
+ * Sets the gapless metadata, signals the track boundary and, when
+ * @codec is not NULL, sets the codec config of the next track, all in
+ * one call. Call it once all data of the current track is written;
+ * the boundary itself is then a single compress_partial_drain().
+ *
+ * return 0 on success, negative on error
+ *
+ * @compress: compress stream to be transitioned to next track
+ * @codec: codec config of the next track, NULL to keep the current one
+ * @mdata: encoder delay and padding of the next track
+ */
+int compress_queue_next_track(struct compress *compress,
+			struct snd_codec *codec, struct compr_gapless_mdata *mdata);
+
+/*
+ * compress_get_metadata: read back the gapless metadata of the stream
+ * The values are read from the device once and cached until new
+ * metadata is set or the next track is signalled.
+ *
+ * return 0 on success, negative on error
+ * returns -ENOTSUP if the backend cannot read metadata back
+ *
+ * @compress: compress stream to be queried
+ * @mdata: returned encoder delay and padding
+ */
+int compress_get_metadata(struct compress *compress,
+			struct compr_gapless_mdata *mdata);
+
+/*
+ * compress_get_codec_params: read back the codec config of the stream
+ * The config is read from the device once and cached until new codec
+ * params are set.
+ *
+ * return 0 on success, negative on error
+ * returns -ENOTSUP if the backend cannot read the config back
+ *
+ * @compress: compress stream to be queried
+ * @codec: returned codec config
+ */
+int compress_get_codec_params(struct compress *compress, struct snd_codec *codec);
+
 /*
  * is_codec_supported:check if the given codec is supported
  * returns true when supported, false if not
@@ -319,6 +699,46 @@ bool is_codec_supported_by_name(const char *name,
  */
 void compress_set_max_poll_wait(struct compress *compress, int milliseconds);
 
+/*
+ * compress_set_adaptive_poll: size poll() waits from the buffered audio
+ * When enabled, a blocking read or write sleeps for the estimated time
+ * until the next fragment frees up, derived from the DSP progress and
+ * the codec bit rate, then checks the buffer again. The total wait is
+ * still bounded by compress_set_max_poll_wait(). This covers drivers
+ * with late or missing period wakeups.
+ *
+ * return 0 on success, negative on error
+ * returns -ENOTSUP if the backend has no adaptive mode
+ *
+ * @compress: compress stream to be configured
+ * @enable: non-zero to enable, zero to use the fixed maximum wait
+ */
+int compress_set_adaptive_poll(struct compress *compress, int enable);
+
+/*
+ * compress_set_low_watermark: get warned before the DSP starves
+ * Every playback write works out how much audio is still queued in the
+ * device buffer, from avail, the buffer size and the byte rate seen in
+ * the timestamps or given by the codec bit rate. Writes finding less
+ * than @threshold_us queued count as underrun risk in compress_stats,
+ * and @cb is called once each time the queue dips below it, from the
+ * thread calling compress_write() and before that write blocks. Until
+ * the byte rate is known, and by default, the watermark is one fragment.
+ * return 0 on success, negative on error
+ * returns -ENOTSUP if the backend cannot tell the queued audio
+ *
+ * @compress: playback stream to be watched
+ * @threshold_us: watermark in microseconds of audio, zero for one fragment
+ * @cb: called with the microseconds of audio still queued, zero when
+ *	unknown, may be NULL to only count
+ * @arg: passed to @cb
+ */
+int compress_set_low_watermark(struct compress *compress,
+		unsigned int threshold_us,
+		void (*cb)(struct compress *compress,
+			   unsigned long long queued_us, void *arg),
+		void *arg);
+
 /* Enable or disable non-blocking mode for write and read */
 void compress_nonblock(struct compress *compress, int nonblock);
 
@@ -332,6 +752,67 @@ int is_compress_ready(struct compress *compress);
 /* Returns a human readable reason for the last error */
 const char *compress_get_error(struct compress *compress);
 
+/*
+ * compress_preopen: open and prefill the next stream in the background
+ * The stream is opened on a worker thread and, if @prefill is given,
+ * handed to it for the initial buffer writes before it is started. The
+ * result is collected by compress_switch_on_drain() or discarded with
+ * compress_preopen_cancel(), one of which must be called.
+ * returns the pending stream on success, NULL on failure
+ *
+ * @name: name of the compress node, as for compress_open_by_name()
+ * @flags: device flags can be COMPRESS_OUT or COMPRESS_IN
+ * @config: stream config requested, copied before returning
+ * @prefill: called on the worker thread with the opened stream, returns
+ *	0 on success, negative on error
+ * @arg: passed to @prefill
+ */
+struct compress_preopen *compress_preopen(const char *name, unsigned int flags,
+		struct compr_config *config,
+		int (*prefill)(struct compress *compress, void *arg), void *arg);
+
+/*
+ * compress_preopen_cancel: wait for a pending stream and close it
+ *
+ * @next: pending stream from compress_preopen()
+ */
+void compress_preopen_cancel(struct compress_preopen *next);
+
+/*
+ * compress_switch_on_drain: drain the current stream and start the next
+ * Drains @current, then starts the stream prepared by compress_preopen()
+ * right away and closes @current. @next is consumed in all cases. On
+ * failure @current is left open, and drained unless the drain failed.
+ * return 0 on success, negative on error
+ * returns -ENODEV if the next stream could not be opened, or the
+ * prefill callback's error
+ *
+ * @current: stream playing now
+ * @next: pending stream from compress_preopen()
+ * @out: returns the started next stream
+ */
+int compress_switch_on_drain(struct compress *current,
+		struct compress_preopen *next, struct compress **out);
+
+/*
+ * compress_reconfigure: set up a stopped or drained stream for new content
+ * Reuses the open handle instead of closing and reopening it. The codec
+ * and buffer layout are checked against the caps read at open time. If
+ * nothing changed the stream is only rearmed, otherwise new params are
+ * set, reopening just the device node when the kernel refuses them on
+ * the current one. The stream has to be prefilled and started again.
+ * If the reopen fails the stream is no longer ready and can only be
+ * closed.
+ * return 0 on success, negative on error
+ * returns -ENOTSUP if the backend cannot reconfigure, close and reopen
+ * the stream instead
+ *
+ * @compress: compress stream to be reconfigured
+ * @config: new config, zero fragment_size or fragments keep the current
+ *	buffer layout and are updated with it
+ */
+int compress_reconfigure(struct compress *compress, struct compr_config *config);
+
 /*
  * compress_set_param: set codec config intended for next track
  * if DSP has support to switch CODEC config during gapless playback
@@ -343,6 +824,119 @@ const char *compress_get_error(struct compress *compress);
  */
 int compress_set_codec_params(struct compress *compress, struct snd_codec *codec);
 
+/*
+ * compress_get_poll_fd: get a descriptor which can be polled for
+ * POLLOUT/POLLIN readiness of the stream
+ * return the descriptor on success, negative on error
+ * returns -ENOTSUP if the backend does not expose one
+ *
+ * @compress: compress stream to be queried
+ */
+int compress_get_poll_fd(struct compress *compress);
+
+/*
+ * compress_get_caps: get the capabilities of the device behind a stream
+ * return 0 on success, negative on error
+ * returns -ENOTSUP if the backend does not report capabilities
+ *
+ * @compress: compress stream to be queried
+ * @caps: returned device capabilities
+ */
+int compress_get_caps(struct compress *compress, struct snd_compr_caps *caps);
+
+#define COMPRESS_TRACE_MAX_ENTRIES	65536
+
+/*
+ * compress_set_trace: record the stream's events in a flight recorder
+ * Writes, reads, avail and poll results of the hw backend and state
+ * changes are kept with their time and result in a ring of fixed size,
+ * the oldest events being overwritten. Must not be called while another
+ * thread uses the stream.
+ * return 0 on success, negative on error
+ *
+ * @compress: compress stream to be traced
+ * @entries: ring size, rounded up to a power of two, zero to disable and
+ *	drop the recorded events
+ * @error_fd: if not negative, the ring is dumped there with
+ *	compress_dump_trace() the first time a call fails
+ */
+int compress_set_trace(struct compress *compress, unsigned int entries,
+		int error_fd);
+
+/*
+ * compress_dump_trace: write the recorded events in tinytrace.h format
+ * May be called from any thread while the stream is in use.
+ * return the number of events written on success, negative on error
+ *
+ * @compress: compress stream with tracing enabled
+ * @fd: descriptor the dump is written to
+ */
+int compress_dump_trace(struct compress *compress, int fd);
+
+#define COMPRESS_BUFFER_HUGEPAGE	0x1
+#define COMPRESS_BUFFER_MLOCK		0x2
+
+/*
+ * compress_alloc_buffer: allocate a transfer buffer for a stream
+ * The buffer holds fragments * fragment_size bytes as negotiated at
+ * open or by compress_reconfigure(). It is page aligned and already
+ * faulted in, so the first writes or reads into it take no page faults.
+ * Returns NULL on failure with errno set.
+ *
+ * @compress: compress stream the buffer is for
+ * @flags: 0 or any of
+ *	COMPRESS_BUFFER_HUGEPAGE: back the buffer with transparent huge
+ *	pages, rounding its size up to 2MB
+ *	COMPRESS_BUFFER_MLOCK: lock the buffer in memory, best effort
+ *	within RLIMIT_MEMLOCK
+ */
+void *compress_alloc_buffer(struct compress *compress, unsigned int flags);
+
+/*
+ * compress_free_buffer: release a buffer of compress_alloc_buffer()
+ * The buffer does not depend on the stream, which may be closed first.
+ * Only pointers returned by compress_alloc_buffer() may be passed, the
+ * size is read from in front of the buffer and is not checked.
+ *
+ * @buffer: buffer to be released, may be NULL
+ */
+void compress_free_buffer(void *buffer);
+
+/*
+ * compress_get_stats: read the counters of a stream
+ * poll_timeouts and underrun_risk are only counted by backends which
+ * track them and stay zero otherwise. May be called from any thread.
+ * return 0 on success, negative on error
+ *
+ * @compress: compress stream to be queried
+ * @stats: returned counters
+ */
+int compress_get_stats(struct compress *compress, struct compress_stats *stats);
+
+/*
+ * compress_metrics_start: export the counters of all streams periodically
+ * A background thread writes the compress_stats of every open stream of
+ * the process in Prometheus text format, either atomically replacing a
+ * file (e.g. for the node_exporter textfile collector) or sent over a
+ * connection to a UNIX stream socket when @target is "unix:<path>".
+ * Streams which failed to open and the inner streams a plugin opens for
+ * itself are not listed. The exporter is also started at the first open
+ * when the environment sets TINYCOMPRESS_METRICS to a target, with the
+ * interval taken from TINYCOMPRESS_METRICS_INTERVAL_MS.
+ * return 0 on success, negative on error
+ * returns -EBUSY when the exporter is already running
+ *
+ * @target: file path or "unix:<socket path>"
+ * @interval_ms: time between two snapshots, zero for the default
+ */
+int compress_metrics_start(const char *target, unsigned int interval_ms);
+
+/*
+ * compress_metrics_stop: stop the exporter started by
+ * compress_metrics_start()
+ */
+void compress_metrics_stop(void);
+
 #if defined(__cplusplus)
 } // extern "C"
 #endif
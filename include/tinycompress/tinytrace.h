@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Binary format written by compress_dump_trace().
+ *
+ * A dump is one struct tinytrace_header followed by header.count
+ * struct tinytrace_record, oldest first. All fields are in the byte
+ * order of the host which wrote the dump; a decoder detects a foreign
+ * dump by the magic reading back swapped.
+ */
+
+#ifndef __TINYTRACE_H__
+#define __TINYTRACE_H__
+
+#include <stdint.h>
+
+#define TINYTRACE_MAGIC		0x54435254	/* "TRCT" */
+#define TINYTRACE_VERSION	1
+
+enum tinytrace_event {
+	TINYTRACE_WRITE = 1,		/* value: bytes asked */
+	TINYTRACE_WRITEV,		/* value: segments */
+	TINYTRACE_READ,			/* value: bytes asked */
+	TINYTRACE_AVAIL,		/* value: bytes available */
+	TINYTRACE_POLL,			/* value: timeout ms << 32 | revents */
+	TINYTRACE_START,
+	TINYTRACE_STOP,
+	TINYTRACE_PAUSE,
+	TINYTRACE_RESUME,
+	TINYTRACE_DRAIN,		/* value: ns spent draining */
+	TINYTRACE_PARTIAL_DRAIN,	/* value: ns spent draining */
+	TINYTRACE_NEXT_TRACK,
+	TINYTRACE_RECONFIGURE,
+	TINYTRACE_NUM_EVENTS,
+};
+
+/*
+ * @total: events recorded since tracing was enabled, the dump holds
+ *	the last @count of them
+ * @start_ns: CLOCK_MONOTONIC time tracing was enabled
+ */
+struct tinytrace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;
+	uint64_t total;
+	uint64_t start_ns;
+};
+
+/*
+ * @time_ns: CLOCK_MONOTONIC time of the event
+ * @value: event specific, see enum tinytrace_event
+ * @result: return value of the call, negative on error
+ * @event: one of enum tinytrace_event
+ */
+struct tinytrace_record {
+	uint64_t time_ns;
+	uint64_t value;
+	int32_t result;
+	uint32_t event;
+};
+
+#endif
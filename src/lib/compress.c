@@ -55,25 +55,157 @@
  * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
 #include <dlfcn.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include "tinycompress/tinycompress.h"
 #include "tinycompress/compress_ops.h"
+#include "compress_probes.h"
+#include "compress_trace.h"
+#include "compress_metrics.h"
 
 #ifndef TINYCOMPRESS_PLUGIN_DIR
 #define TINYCOMPRESS_PLUGIN_DIR "/usr/lib/tinycompress-lib/"
 #endif
 
+#define DEFAULT_POSITION_INTERVAL_MS	100
+#define MEDIA_CLOCK_POINTS		32
+#define START_GROUP_MEASURE_MS		200
+#define COMPRESS_HUGEPAGE_SIZE		(2UL << 20)
+
+/*
+ * Last hw position snapshot used by compress_get_position(),
+ * extrapolated with CLOCK_MONOTONIC while the stream is running.
+ */
+struct compress_position {
+	unsigned long long samples;
+	unsigned int sampling_rate;
+	unsigned long long time_ns;	/* when the snapshot was taken */
+	unsigned long long reported;	/* last position handed out */
+	unsigned long long interval_ns;
+	int valid;
+	int running;
+};
+
+/*
+ * Recent (monotonic time, media time) pairs, both in ns, fitted with a
+ * least squares line whose slope is the DSP to system clock rate ratio.
+ */
+struct media_clock {
+	unsigned long long mono_ns[MEDIA_CLOCK_POINTS];
+	unsigned long long media_ns[MEDIA_CLOCK_POINTS];
+	unsigned int head;
+	unsigned int count;
+	unsigned int sampling_rate;
+};
+
+/*
+ * Fast start bookkeeping: the stream is started from compress_write()
+ * once threshold bytes are buffered, and the startup is timed from the
+ * first write to the first rendered sample.
+ */
+struct compress_startup {
+	unsigned int threshold;
+	unsigned long long written;	/* bytes buffered before the start */
+	unsigned long long first_write_ns;
+	unsigned long long start_ns;
+	unsigned long long first_audio_ns;
+	int autostarted;
+};
+
+/* a stream being opened and prefilled by a worker thread */
+struct compress_preopen {
+	pthread_t thread;
+	char *name;
+	unsigned int flags;
+	struct compr_config config;
+	struct snd_codec codec;
+	int (*prefill)(struct compress *compress, void *arg);
+	void *arg;
+	struct compress *compress;
+	int ret;
+};
+
+/* coalesces small writes into whole fragments, see compress_flush() */
+struct compress_stage {
+	char *buf;
+	unsigned int size;
+	unsigned int used;
+	int flushing;
+};
+
+/* a drain running in the background, see compress_drain_async() */
+struct compress_drain {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled once done is set */
+	int pending;		/* thread started and not joined yet */
+	int done;		/* drain returned, result is valid */
+	int partial;
+	int result;
+	int efd;		/* kicked once the drain returned */
+	void (*cb)(struct compress *compress, int ret, void *arg);
+	void *arg;
+};
+
 struct compress {
 	struct compress_ops *ops;
 	void *data;
 	void *dl_hdl;
+	/* negotiated at open */
+	unsigned int flags;
+	unsigned int fragment_size;
+	unsigned int fragments;
+	struct compress_stage stage;
+	struct compress_position pos;
+	struct media_clock clock;
+	struct compress_startup startup;
+	struct compress_trace *trace;
+	struct compress_stats stats;
+	void (*lwm_cb)(struct compress *compress,
+		       unsigned long long queued_us, void *arg);
+	void *lwm_arg;
+	struct compress_drain *drain;
+	/* open streams, see compress_foreach_stream() */
+	char name[COMPRESS_STREAM_NAME_MAX];
+	unsigned int id;
+	struct compress *open_next;
+	/* hw node held by this handle, see compress_open_any() */
+	int held;
+	unsigned int card;
+	unsigned int device;
+	struct compress *held_next;
 };
 
+static pthread_mutex_t compress_held_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compress *compress_held;
+
+static pthread_mutex_t compress_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compress *compress_streams;
+static unsigned int compress_stream_ids;
+/* > 0 while a plugin opens its inner streams in this thread */
+static __thread unsigned int compress_open_depth;
+
+/* plugins linked in, see COMPRESS_PLUGIN_DEFINE() */
+static pthread_mutex_t compress_plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compress_plugin *compress_plugins;
+
+#ifdef COMPRESS_PLUGIN_BUILTIN
+extern struct compress_plugin *const compress_builtin_plugins[]
+	__attribute__((visibility("hidden")));
+#endif
+
 extern struct compress_ops compress_hw_ops;
 
 const char *compress_get_error(struct compress *compress)
@@ -91,6 +223,109 @@ int is_compress_ready(struct compress *compress)
 	return compress->ops->is_compress_ready(compress->data);
 }
 
+/* remember which hw nodes this process has open */
+static void compress_hold(struct compress *compress, const char *name)
+{
+	if (sscanf(&name[3], "%u,%u", &compress->card, &compress->device) != 2 ||
+	    !is_compress_ready(compress))
+		return;
+
+	pthread_mutex_lock(&compress_held_lock);
+	compress->held = 1;
+	compress->held_next = compress_held;
+	compress_held = compress;
+	pthread_mutex_unlock(&compress_held_lock);
+}
+
+static void compress_release(struct compress *compress)
+{
+	struct compress **p;
+
+	if (!compress->held)
+		return;
+
+	pthread_mutex_lock(&compress_held_lock);
+	for (p = &compress_held; *p; p = &(*p)->held_next) {
+		if (*p == compress) {
+			*p = compress->held_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&compress_held_lock);
+}
+
+static bool compress_is_held(unsigned int card, unsigned int device)
+{
+	struct compress *compress;
+	bool held = false;
+
+	pthread_mutex_lock(&compress_held_lock);
+	for (compress = compress_held; compress; compress = compress->held_next) {
+		if (compress->card == card && compress->device == device) {
+			held = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&compress_held_lock);
+	return held;
+}
+
+/*
+ * Only streams the application got are listed: a failed open has no
+ * counters worth exporting, and the inner stream of a plugin like tee
+ * would count the same traffic twice.
+ */
+static void compress_add_stream(struct compress *compress, const char *name)
+{
+	if (compress_open_depth || !is_compress_ready(compress))
+		return;
+
+	snprintf(compress->name, sizeof(compress->name), "%.*s",
+		 COMPRESS_STREAM_NAME_MAX - 1, name);
+
+	pthread_mutex_lock(&compress_streams_lock);
+	compress->id = ++compress_stream_ids;
+	compress->open_next = compress_streams;
+	compress_streams = compress;
+	pthread_mutex_unlock(&compress_streams_lock);
+
+	compress_metrics_autostart();
+}
+
+static void compress_remove_stream(struct compress *compress)
+{
+	struct compress **p;
+
+	pthread_mutex_lock(&compress_streams_lock);
+	for (p = &compress_streams; *p; p = &(*p)->open_next) {
+		if (*p == compress) {
+			*p = compress->open_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&compress_streams_lock);
+}
+
+void compress_foreach_stream(void (*fn)(const struct compress_stream_info *info,
+		void *arg), void *arg)
+{
+	struct compress_stream_info info;
+	struct compress *compress;
+
+	/* compress_close() waits for the lock before freeing the stream */
+	pthread_mutex_lock(&compress_streams_lock);
+	for (compress = compress_streams; compress;
+	     compress = compress->open_next) {
+		info.name = compress->name;
+		info.id = compress->id;
+		info.flags = compress->flags;
+		if (compress_get_stats(compress, &info.stats))
+			continue;
+		fn(&info, arg);
+	}
+	pthread_mutex_unlock(&compress_streams_lock);
+}
+
 struct compress *compress_open(unsigned int card, unsigned int device,
 		unsigned int flags, struct compr_config *config)
 {
@@ -103,14 +338,84 @@ struct compress *compress_open(unsigned int card, unsigned int device,
 		return NULL;
 
 	compress->ops = &compress_hw_ops;
+	compress->pos.interval_ns = DEFAULT_POSITION_INTERVAL_MS * 1000000ULL;
+
 	compress->data =  compress->ops->open_by_name(name, flags, config);
 	if (compress->data == NULL) {
 		free(compress);
 		return NULL;
 	}
+	compress->flags = flags;
+	compress->fragment_size = config->fragment_size;
+	compress->fragments = config->fragments;
+	compress_hold(compress, name);
+	compress_add_stream(compress, name);
 	return compress;
 }
 
+void compress_plugin_register(struct compress_plugin *plugin)
+{
+	struct compress_plugin *p;
+
+	pthread_mutex_lock(&compress_plugins_lock);
+	/* a bundled plugin comes from both its constructor and the table */
+	for (p = compress_plugins; p; p = p->next)
+		if (p == plugin)
+			goto unlock;
+	plugin->next = compress_plugins;
+	compress_plugins = plugin;
+unlock:
+	pthread_mutex_unlock(&compress_plugins_lock);
+}
+
+#ifdef COMPRESS_PLUGIN_BUILTIN
+static void compress_register_builtin_plugins(void)
+{
+	unsigned int i;
+
+	for (i = 0; compress_builtin_plugins[i]; i++)
+		compress_plugin_register(compress_builtin_plugins[i]);
+}
+#endif
+
+static struct compress_ops *compress_plugin_find(const char *name)
+{
+	struct compress_plugin *plugin;
+	struct compress_ops *ops = NULL;
+	size_t len = strcspn(name, ":");
+#ifdef COMPRESS_PLUGIN_BUILTIN
+	static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&builtin_once, compress_register_builtin_plugins);
+#endif
+
+	pthread_mutex_lock(&compress_plugins_lock);
+	for (plugin = compress_plugins; plugin; plugin = plugin->next) {
+		if (strlen(plugin->name) == len &&
+		    !strncmp(plugin->name, name, len)) {
+			ops = plugin->ops;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&compress_plugins_lock);
+	return ops;
+}
+
+static int compress_plugin_ops_valid(struct compress_ops *ops)
+{
+	if (ops->magic != COMPRESS_OPS_V2 && ops->magic != COMPRESS_OPS_V3) {
+		fprintf(stderr, "%s: bad magic (%08x)\n", __func__, ops->magic);
+		return 0;
+	}
+	if (ops->magic == COMPRESS_OPS_V3 &&
+	    ops->size < offsetof(struct compress_ops, features) +
+			sizeof(ops->features)) {
+		fprintf(stderr, "%s: bad size (%u)\n", __func__, ops->size);
+		return 0;
+	}
+	return 1;
+}
+
 static int populate_compress_plugin_ops(struct compress *compress, const char *name)
 {
 	char *token, *token_saveptr;
@@ -120,6 +425,11 @@ static int populate_compress_plugin_ops(struct compress *compress, const char *n
 	const char *err = NULL;
 	const char *s;
 
+	/* linked in plugins take precedence over the plugin directory */
+	compress->ops = compress_plugin_find(name);
+	if (compress->ops)
+		return compress_plugin_ops_valid(compress->ops) ? 0 : -1;
+
 	token = strdup(name);
 	compr_name = strtok_r(token, ":", &token_saveptr);
 
@@ -145,9 +455,7 @@ static int populate_compress_plugin_ops(struct compress *compress, const char *n
 		dlclose(dl_hdl);
 		return -1;
 	}
-	if (compress->ops->magic != COMPRESS_OPS_V2) {
-		fprintf(stderr, "%s: dlsym to ops failed, bad magic (%08x)\n",
-				__func__, compress->ops->magic);
+	if (!compress_plugin_ops_valid(compress->ops)) {
 		dlclose(dl_hdl);
 		return -1;
 	}
@@ -172,7 +480,7 @@ struct compress *compress_open_by_name(const char *name,
 	if (!compress)
 		return NULL;
 
-	if ((name[0] == 'h') || (name[1] == 'w') || (name[2] == ':')) {
+	if (!strncmp(name, "hw:", 3)) {
 		compress->ops = &compress_hw_ops;
 	} else {
 		if (populate_compress_plugin_ops(compress, name)) {
@@ -181,177 +489,1577 @@ struct compress *compress_open_by_name(const char *name,
 		}
 	}
 
+	compress->pos.interval_ns = DEFAULT_POSITION_INTERVAL_MS * 1000000ULL;
+
+	compress_open_depth++;
 	compress->data =  compress->ops->open_by_name(name, flags, config);
+	compress_open_depth--;
+	COMPRESS_PROBE3(open, name, compress->ops, compress->data);
 	if (compress->data == NULL) {
 		if (compress->dl_hdl)
 			dlclose(compress->dl_hdl);
 		free(compress);
 		return NULL;
 	}
+	compress->flags = flags;
+	if (config) {
+		compress->fragment_size = config->fragment_size;
+		compress->fragments = config->fragments;
+	}
+	if (compress->ops == &compress_hw_ops)
+		compress_hold(compress, name);
+	compress_add_stream(compress, name);
 	return compress;
 }
 
-void compress_close(struct compress *compress)
+/*
+ * Order candidates by fit: nodes offering fewer codecs come first so
+ * the versatile ones stay free for streams only they can serve.
+ */
+static int compress_fit_cmp(const void *a, const void *b)
 {
-	compress->ops->close(compress->data);
-	if (compress->dl_hdl)
-		dlclose(compress->dl_hdl);
+	const struct compress_device_info *da = a, *db = b;
 
-	free(compress);
+	if (da->num_codecs != db->num_codecs)
+		return da->num_codecs < db->num_codecs ? -1 : 1;
+	if (da->card != db->card)
+		return da->card < db->card ? -1 : 1;
+	return da->device < db->device ? -1 : da->device > db->device;
 }
 
-int compress_get_hpointer(struct compress *compress,
-		unsigned int *avail, struct timespec *tstamp)
+static bool compress_fits(const struct compress_device_info *info,
+		unsigned int flags, const struct compr_config *config)
 {
-	unsigned long long _avail;
-	int ret;
+	unsigned int direction, i;
 
-	ret = compress->ops->get_hpointer(compress->data, &_avail, tstamp);
-	if (ret >= 0) {
-		if (_avail > UINT_MAX) {
-			ret = -ERANGE;
-			_avail = UINT_MAX;
-		}
-		*avail = (unsigned int)_avail;
-	}
-	return ret;
-}
+	direction = (flags & COMPRESS_OUT) ? SND_COMPRESS_CAPTURE :
+					     SND_COMPRESS_PLAYBACK;
+	if (info->error || info->direction != direction)
+		return false;
 
-int compress_get_hpointer64(struct compress *compress,
-		unsigned long long *avail, struct timespec *tstamp)
-{
-	return compress->ops->get_hpointer(compress->data, avail, tstamp);
+	if (config->fragment_size && config->fragments &&
+	    (config->fragment_size < info->min_fragment_size ||
+	     config->fragment_size > info->max_fragment_size ||
+	     config->fragments < info->min_fragments ||
+	     config->fragments > info->max_fragments))
+		return false;
+
+	for (i = 0; i < info->num_codecs; i++)
+		if (info->codecs[i] == config->codec->id)
+			return true;
+	return false;
 }
 
-int compress_get_tstamp(struct compress *compress,
-			unsigned int *samples, unsigned int *sampling_rate)
+struct compress *compress_open_any(unsigned int flags,
+		struct compr_config *config, unsigned int *card,
+		unsigned int *device)
 {
-	unsigned long long _samples;
-	int ret;
+	struct compress_device_info *devices;
+	struct compress *compress = NULL;
+	struct compr_config try;
+	int i, count, fits = 0, err = ENODEV;
 
-	ret = compress->ops->get_tstamp(compress->data, &_samples, sampling_rate);
-	if (ret >= 0) {
-		if (_samples > UINT_MAX) {
-			ret = -ERANGE;
-			_samples = UINT_MAX;
+	if (!config || !config->codec) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	count = compress_enumerate(&devices, 0);
+	if (count <= 0) {
+		errno = count < 0 ? -count : ENODEV;
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++)
+		if (compress_fits(&devices[i], flags, config) &&
+		    !compress_is_held(devices[i].card, devices[i].device))
+			devices[fits++] = devices[i];
+	qsort(devices, fits, sizeof(*devices), compress_fit_cmp);
+
+	/* another process may hold a candidate, move on to the next */
+	for (i = 0; i < fits; i++) {
+		/* the open fills in the "don't care" fields, per candidate */
+		try = *config;
+		compress = compress_open(devices[i].card, devices[i].device,
+					 flags, &try);
+		if (compress && is_compress_ready(compress)) {
+			*config = try;
+			if (card)
+				*card = devices[i].card;
+			if (device)
+				*device = devices[i].device;
+			break;
 		}
-		*samples = (unsigned int)_samples;
+		if (compress)
+			compress_close(compress);
+		compress = NULL;
+		err = EBUSY;
 	}
-	return ret;
+
+	free(devices);
+	if (!compress)
+		errno = err;
+	return compress;
 }
 
-int compress_get_tstamp64(struct compress *compress,
-			unsigned long long *samples, unsigned int *sampling_rate)
+static unsigned long long compress_monotonic_ns(void)
 {
-	return compress->ops->get_tstamp(compress->data, samples, sampling_rate);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-int compress_write(struct compress *compress, const void *buf, unsigned int size)
+void compress_close(struct compress *compress)
 {
-	return compress->ops->write(compress->data, buf, size);
+	struct compress_drain *drain = compress->drain;
+
+	compress_remove_stream(compress);
+	if (drain) {
+		/* stopping the stream makes a running drain return */
+		if (drain->pending) {
+			compress->ops->stop(compress->data);
+			pthread_join(drain->thread, NULL);
+		}
+		close(drain->efd);
+		pthread_cond_destroy(&drain->cond);
+		pthread_mutex_destroy(&drain->lock);
+		free(drain);
+	}
+	compress_release(compress);
+	free(compress->stage.buf);
+	compress->ops->close(compress->data);
+	if (compress->dl_hdl)
+		dlclose(compress->dl_hdl);
+
+	if (compress->trace)
+		free(compress->trace->slots);
+	free(compress->trace);
+	free(compress);
 }
 
-int compress_read(struct compress *compress, void *buf, unsigned int size)
+int compress_set_trace(struct compress *compress, unsigned int entries,
+		int error_fd)
 {
-	return compress->ops->read(compress->data, buf, size);
+	struct compress_trace *trace;
+	unsigned int size = 1;
+
+	if (entries > COMPRESS_TRACE_MAX_ENTRIES)
+		return -EINVAL;
+
+	if (compress->ops == &compress_hw_ops)
+		compress_hw_set_trace(compress->data, NULL);
+	if (compress->trace)
+		free(compress->trace->slots);
+	free(compress->trace);
+	compress->trace = NULL;
+	if (!entries)
+		return 0;
+
+	while (size < entries)
+		size <<= 1;
+
+	trace = calloc(1, sizeof(*trace));
+	if (!trace)
+		return -ENOMEM;
+	trace->slots = calloc(size, sizeof(*trace->slots));
+	if (!trace->slots) {
+		free(trace);
+		return -ENOMEM;
+	}
+	trace->mask = size - 1;
+	trace->error_fd = error_fd;
+	trace->start_ns = compress_monotonic_ns();
+
+	compress->trace = trace;
+	if (compress->ops == &compress_hw_ops)
+		compress_hw_set_trace(compress->data, trace);
+	return 0;
 }
 
-int compress_start(struct compress *compress)
+static int compress_trace_write(int fd, const void *buf, size_t size)
 {
-	return compress->ops->start(compress->data);
+	const char *p = buf;
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
 }
 
-int compress_stop(struct compress *compress)
+int compress_dump_trace(struct compress *compress, int fd)
 {
-	return compress->ops->stop(compress->data);
+	struct compress_trace *trace = compress->trace;
+	struct tinytrace_header hdr;
+	struct tinytrace_record *recs;
+	struct compress_trace_slot *slot;
+	uint64_t head, idx, seq;
+	unsigned int count = 0;
+	int ret;
+
+	if (!trace)
+		return -EINVAL;
+
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	idx = head > trace->mask + 1ULL ? head - (trace->mask + 1ULL) : 0;
+	recs = malloc((head - idx) * sizeof(*recs) + 1);
+	if (!recs)
+		return -ENOMEM;
+
+	/* oldest first, skipping slots a writer is busy with */
+	for (; idx < head; idx++) {
+		slot = &trace->slots[idx & trace->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		recs[count] = slot->rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == idx + 1 &&
+		    __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			count++;
+	}
+
+	hdr.magic = TINYTRACE_MAGIC;
+	hdr.version = TINYTRACE_VERSION;
+	hdr.record_size = sizeof(*recs);
+	hdr.count = count;
+	hdr.total = head;
+	hdr.start_ns = trace->start_ns;
+
+	ret = compress_trace_write(fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = compress_trace_write(fd, recs, count * sizeof(*recs));
+	free(recs);
+	return ret ? ret : (int)count;
 }
 
-int compress_pause(struct compress *compress)
+/* a background drain may update the counters next to the stream's thread */
+static void compress_stat_add(unsigned long long *counter,
+		unsigned long long n)
 {
-	return compress->ops->pause(compress->data);
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-int compress_resume(struct compress *compress)
+static void compress_stat_max(unsigned long long *counter,
+		unsigned long long n)
 {
-	return compress->ops->resume(compress->data);
+	unsigned long long old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (n > old && !__atomic_compare_exchange_n(counter, &old, n, 0,
+						       __ATOMIC_RELAXED,
+						       __ATOMIC_RELAXED))
+		;
 }
 
-int compress_drain(struct compress *compress)
+static void compress_stats_update(struct compress_stats *stats,
+		unsigned int event, unsigned long long value, int result)
 {
-	return compress->ops->drain(compress->data);
+	if (result < 0) {
+		compress_stat_add(&stats->errors, 1);
+		return;
+	}
+
+	switch (event) {
+	case TINYTRACE_WRITE:
+	case TINYTRACE_READ:
+		if ((unsigned long long)result < value)
+			compress_stat_add(&stats->partial_transfers, 1);
+		/* fall through */
+	case TINYTRACE_WRITEV:
+		compress_stat_add(&stats->transfers, 1);
+		compress_stat_add(&stats->bytes, result);
+		break;
+	case TINYTRACE_DRAIN:
+	case TINYTRACE_PARTIAL_DRAIN:
+		compress_stat_add(&stats->drains, 1);
+		compress_stat_add(&stats->drain_ns, value);
+		compress_stat_max(&stats->drain_max_ns, value);
+		break;
+	default:
+		break;
+	}
 }
 
-int compress_partial_drain(struct compress *compress)
+/*
+ * Account a generic layer event in the stream's counters and record it
+ * in the flight recorder, dumping the ring on the first error.
+ */
+static void compress_stream_event(struct compress *compress,
+		unsigned int event, unsigned long long value, int result)
 {
-	return compress->ops->partial_drain(compress->data);
+	struct compress_trace *trace = compress->trace;
+	int fd, err;
+
+	compress_stats_update(&compress->stats, event, value, result);
+	if (!trace)
+		return;
+
+	compress_trace_record(trace, event, value, result);
+	if (result < 0 && trace->error_fd >= 0) {
+		fd = trace->error_fd;
+		trace->error_fd = -1;
+		/* the caller reads errno of the failed call, not of the dump */
+		err = errno;
+		compress_dump_trace(compress, fd);
+		errno = err;
+	}
 }
 
-int compress_next_track(struct compress *compress)
+static void media_clock_reset(struct media_clock *clock)
 {
-	return compress->ops->next_track(compress->data);
+	clock->head = 0;
+	clock->count = 0;
 }
 
-int compress_set_gapless_metadata(struct compress *compress,
-	struct compr_gapless_mdata *mdata)
+static void media_clock_add(struct media_clock *clock,
+		unsigned long long mono_ns, unsigned long long media_ns,
+		unsigned int sampling_rate)
 {
-	return compress->ops->set_gapless_metadata(compress->data, mdata);
+	unsigned int last;
+
+	/* a new track or a counter reset starts a new fit */
+	last = (clock->head + MEDIA_CLOCK_POINTS - 1) % MEDIA_CLOCK_POINTS;
+	if (clock->count && (sampling_rate != clock->sampling_rate ||
+			     media_ns < clock->media_ns[last]))
+		media_clock_reset(clock);
+
+	clock->sampling_rate = sampling_rate;
+	clock->mono_ns[clock->head] = mono_ns;
+	clock->media_ns[clock->head] = media_ns;
+	clock->head = (clock->head + 1) % MEDIA_CLOCK_POINTS;
+	if (clock->count < MEDIA_CLOCK_POINTS)
+		clock->count++;
 }
 
-bool is_codec_supported(unsigned int card, unsigned int device,
-		unsigned int flags, struct snd_codec *codec)
+/*
+ * Feed a hw timestamp taken at mono_ns into the media clock, and date
+ * the first rendered sample if the startup is still being timed.
+ */
+static void compress_record_tstamp(struct compress *compress,
+		unsigned long long mono_ns, unsigned long long media_ns,
+		unsigned int sampling_rate)
 {
-	struct compress_ops *ops = &compress_hw_ops;
-	char name[128];
+	struct compress_startup *startup = &compress->startup;
 
-	snprintf(name, sizeof(name), "hw:%u,%u", card, device);
+	if (!compress->pos.running)
+		return;
 
-	return ops->is_codec_supported_by_name(name, flags, codec);
+	media_clock_add(&compress->clock, mono_ns, media_ns, sampling_rate);
+
+	if (startup->start_ns && !startup->first_audio_ns && media_ns) {
+		startup->first_audio_ns = mono_ns - media_ns;
+		if (startup->first_audio_ns < startup->start_ns)
+			startup->first_audio_ns = startup->start_ns;
+	}
 }
 
-bool is_codec_supported_by_name(const char *name,
-		unsigned int flags, struct snd_codec *codec)
+/*
+ * Query the hw timestamp and record it against the monotonic time
+ * halfway through the call, which is when the DSP was most likely read.
+ */
+static int compress_query_tstamp(struct compress *compress,
+		unsigned long long *samples, unsigned int *sampling_rate,
+		unsigned long long *mono_ns)
 {
-	struct compress *compress;
-	bool ret;
+	unsigned long long before;
+	int ret;
 
-	compress = calloc(1, sizeof(struct compress));
-	if (!compress)
-		return false;
+	before = compress_monotonic_ns();
+	ret = compress->ops->get_tstamp(compress->data, samples, sampling_rate);
+	if (ret < 0)
+		return ret;
+	*mono_ns = before + (compress_monotonic_ns() - before) / 2;
 
-	if ((name[0] == 'h') || (name[1] == 'w') || (name[2] == ':')) {
-		compress->ops = &compress_hw_ops;
-	} else {
-		if (populate_compress_plugin_ops(compress, name)) {
-			free(compress);
-			return NULL;
-		}
-	}
+	if (*sampling_rate)
+		compress_record_tstamp(compress, *mono_ns,
+				*samples * 1000000000ULL / *sampling_rate,
+				*sampling_rate);
+	return ret;
+}
 
-	ret = compress->ops->is_codec_supported_by_name(name, flags, codec);
+/* same as compress_query_tstamp(), the hw time is already in a timespec */
+static int compress_query_hpointer(struct compress *compress,
+		unsigned long long *avail, struct timespec *tstamp)
+{
+	unsigned long long before, mono_ns;
+	int ret;
 
-	if (compress->dl_hdl)
-		dlclose(compress->dl_hdl);
-	free(compress);
+	before = compress_monotonic_ns();
+	ret = compress->ops->get_hpointer(compress->data, avail, tstamp);
+	if (ret < 0)
+		return ret;
+	mono_ns = before + (compress_monotonic_ns() - before) / 2;
 
+	compress_record_tstamp(compress, mono_ns,
+			tstamp->tv_sec * 1000000000ULL + tstamp->tv_nsec,
+			compress->clock.sampling_rate);
 	return ret;
 }
 
-void compress_set_max_poll_wait(struct compress *compress, int milliseconds)
+int compress_get_hpointer(struct compress *compress,
+		unsigned int *avail, struct timespec *tstamp)
 {
-	compress->ops->set_max_poll_wait(compress->data, milliseconds);
+	unsigned long long _avail;
+	int ret;
+
+	ret = compress_query_hpointer(compress, &_avail, tstamp);
+	if (ret >= 0) {
+		if (_avail > UINT_MAX) {
+			ret = -ERANGE;
+			_avail = UINT_MAX;
+		}
+		*avail = (unsigned int)_avail;
+	}
+	return ret;
 }
 
-void compress_nonblock(struct compress *compress, int nonblock)
+int compress_get_hpointer64(struct compress *compress,
+		unsigned long long *avail, struct timespec *tstamp)
 {
-	compress->ops->set_nonblock(compress->data, nonblock);
+	return compress_query_hpointer(compress, avail, tstamp);
 }
 
-int compress_wait(struct compress *compress, int timeout_ms)
+int compress_get_snapshot(struct compress *compress,
+		struct compress_snapshot *snapshot)
 {
-	return compress->ops->wait(compress->data, timeout_ms);
+	struct timespec tstamp;
+	int ret;
+
+	if (!COMPRESS_OPS_HAS(compress->ops, get_snapshot,
+			      COMPRESS_OPS_F_SNAPSHOT)) {
+		memset(snapshot, 0, sizeof(*snapshot));
+		ret = compress_query_hpointer(compress, &snapshot->avail, &tstamp);
+		if (ret < 0)
+			return ret;
+		clock_gettime(CLOCK_MONOTONIC, &snapshot->mono);
+		return compress->ops->get_tstamp(compress->data,
+				&snapshot->pcm_io_frames, &snapshot->sampling_rate);
+	}
+
+	ret = compress->ops->get_snapshot(compress->data, snapshot);
+	if (ret < 0)
+		return ret;
+
+	if (snapshot->sampling_rate)
+		compress_record_tstamp(compress,
+				snapshot->mono.tv_sec * 1000000000ULL +
+				snapshot->mono.tv_nsec,
+				snapshot->pcm_io_frames * 1000000000ULL /
+				snapshot->sampling_rate,
+				snapshot->sampling_rate);
+	return ret;
 }
 
-int compress_set_codec_params(struct compress *compress, struct snd_codec *codec)
+int compress_get_tstamp(struct compress *compress,
+			unsigned int *samples, unsigned int *sampling_rate)
 {
-	return compress->ops->set_codec_params(compress->data, codec);
+	unsigned long long _samples, mono_ns;
+	int ret;
+
+	ret = compress_query_tstamp(compress, &_samples, sampling_rate, &mono_ns);
+	if (ret >= 0) {
+		if (_samples > UINT_MAX) {
+			ret = -ERANGE;
+			_samples = UINT_MAX;
+		}
+		*samples = (unsigned int)_samples;
+	}
+	return ret;
+}
+
+int compress_get_tstamp64(struct compress *compress,
+			unsigned long long *samples, unsigned int *sampling_rate)
+{
+	unsigned long long mono_ns;
+
+	return compress_query_tstamp(compress, samples, sampling_rate, &mono_ns);
+}
+
+/* true while compress_write() still has to start the stream itself */
+static int compress_start_pending(struct compress *compress)
+{
+	return compress->startup.threshold && !compress->startup.start_ns;
+}
+
+static int compress_write_raw(struct compress *compress, const void *buf,
+		unsigned int size)
+{
+	struct compress_startup *startup = &compress->startup;
+	unsigned int prefill;
+	int ret, rest;
+
+	if (!startup->start_ns && !startup->first_write_ns)
+		startup->first_write_ns = compress_monotonic_ns();
+
+	if (!compress_start_pending(compress))
+		return compress->ops->write(compress->data, buf, size);
+
+	/*
+	 * Fast start: write only up to the threshold, start the stream and
+	 * then block on the remainder while the DSP is already playing.
+	 */
+	prefill = startup->threshold - startup->written;
+	if (prefill > size)
+		prefill = size;
+	ret = compress->ops->write(compress->data, buf, prefill);
+	if (ret <= 0)
+		return ret;
+	startup->written += ret;
+	if (startup->written < startup->threshold)
+		return ret;
+
+	if (compress_start(compress)) {
+		/* leave the error to the caller's own compress_start() */
+		startup->threshold = 0;
+		return ret;
+	}
+	startup->autostarted = 1;
+
+	if ((unsigned int)ret == size || (unsigned int)ret != prefill)
+		return ret;
+	rest = compress->ops->write(compress->data, (const char *)buf + ret,
+				    size - ret);
+	return rest < 0 ? ret : ret + rest;
+}
+
+/* returns the bytes left staged, negative on error */
+static int compress_stage_flush(struct compress *compress)
+{
+	struct compress_stage *stage = &compress->stage;
+	int ret;
+
+	/* a fast start triggered by the flush itself must not recurse */
+	if (!stage->used || stage->flushing)
+		return stage->used;
+
+	stage->flushing = 1;
+	ret = compress_write_raw(compress, stage->buf, stage->used);
+	stage->flushing = 0;
+	if (ret < 0)
+		return ret;
+
+	stage->used -= ret;
+	memmove(stage->buf, stage->buf + ret, stage->used);
+	return stage->used;
+}
+
+/* push out every staged byte before a stream boundary, 0 once empty */
+static int compress_stage_empty(struct compress *compress)
+{
+	unsigned int used;
+	int ret;
+
+	while (compress->stage.used) {
+		used = compress->stage.used;
+		ret = compress_stage_flush(compress);
+		if (ret < 0)
+			return ret;
+		/* no room left on a nonblocking stream */
+		if ((unsigned int)ret == used)
+			return -EAGAIN;
+	}
+	return 0;
+}
+
+static int compress_write_staged(struct compress *compress, const void *buf,
+		unsigned int size)
+{
+	struct compress_stage *stage = &compress->stage;
+	const char *p = buf;
+	unsigned int done = 0, len;
+	int ret;
+
+	if (!stage->buf)
+		return compress_write_raw(compress, buf, size);
+
+	while (done < size) {
+		/* whole fragments need no staging */
+		if (!stage->used && size - done >= stage->size) {
+			len = (size - done) - (size - done) % stage->size;
+			ret = compress_write_raw(compress, p + done, len);
+			if (ret < 0)
+				return done ? (int)done : ret;
+			done += ret;
+			if ((unsigned int)ret != len)
+				break;
+			continue;
+		}
+
+		len = stage->size - stage->used;
+		if (len > size - done)
+			len = size - done;
+		memcpy(stage->buf + stage->used, p + done, len);
+		stage->used += len;
+		done += len;
+
+		if (stage->used == stage->size) {
+			ret = compress_stage_flush(compress);
+			if (ret < 0)
+				return ret;
+			/* non-blocking and the device is full */
+			if (stage->used == stage->size)
+				break;
+		}
+	}
+	return done;
+}
+
+int compress_write(struct compress *compress, const void *buf, unsigned int size)
+{
+	int ret;
+
+	COMPRESS_PROBE2(write_entry, compress, size);
+	ret = compress_write_staged(compress, buf, size);
+	COMPRESS_PROBE2(write_return, compress, ret);
+	compress_stream_event(compress, TINYTRACE_WRITE, size, ret);
+	return ret;
+}
+
+int compress_set_write_staging(struct compress *compress, int enable)
+{
+	struct compress_stage *stage = &compress->stage;
+	int ret;
+
+	if (!enable) {
+		ret = compress_stage_flush(compress);
+		if (ret)
+			return ret < 0 ? ret : -EAGAIN;
+		free(stage->buf);
+		stage->buf = NULL;
+		return 0;
+	}
+
+	if (stage->buf)
+		return 0;
+	if ((compress->flags & COMPRESS_OUT) || !compress->fragment_size)
+		return -EINVAL;
+
+	stage->buf = malloc(compress->fragment_size);
+	if (!stage->buf)
+		return -ENOMEM;
+	stage->size = compress->fragment_size;
+	stage->used = 0;
+	return 0;
+}
+
+int compress_flush(struct compress *compress)
+{
+	return compress_stage_flush(compress);
+}
+
+int compress_writev(struct compress *compress, const struct iovec *iov, int iovcnt)
+{
+	int i, ret, total = 0;
+
+	if (COMPRESS_OPS_HAS(compress->ops, writev, COMPRESS_OPS_F_WRITEV) &&
+	    !compress_start_pending(compress) && !compress->stage.buf) {
+		if (!compress->startup.start_ns && !compress->startup.first_write_ns)
+			compress->startup.first_write_ns = compress_monotonic_ns();
+		COMPRESS_PROBE2(writev_entry, compress, iovcnt);
+		ret = compress->ops->writev(compress->data, iov, iovcnt);
+		COMPRESS_PROBE2(writev_return, compress, ret);
+		compress_stream_event(compress, TINYTRACE_WRITEV, iovcnt, ret);
+		return ret;
+	}
+
+	/* generic fallback, one write per segment */
+	for (i = 0; i < iovcnt; i++) {
+		ret = compress_write(compress, iov[i].iov_base, iov[i].iov_len);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		if ((size_t)ret != iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+int compress_read(struct compress *compress, void *buf, unsigned int size)
+{
+	int ret;
+
+	COMPRESS_PROBE2(read_entry, compress, size);
+	ret = compress->ops->read(compress->data, buf, size);
+	COMPRESS_PROBE2(read_return, compress, ret);
+	compress_stream_event(compress, TINYTRACE_READ, size, ret);
+	return ret;
+}
+
+/* a state change makes the current snapshot useless for extrapolation */
+static void compress_position_set_running(struct compress *compress, int running)
+{
+	compress->pos.running = running;
+	compress->pos.valid = 0;
+	media_clock_reset(&compress->clock);
+}
+
+/* the stream is back at its beginning, nothing played nor buffered */
+static void compress_reset_stream_state(struct compress *compress)
+{
+	compress_position_set_running(compress, 0);
+	compress->pos.reported = 0;
+	compress->startup.written = 0;
+	compress->startup.first_write_ns = 0;
+	compress->startup.start_ns = 0;
+	compress->startup.autostarted = 0;
+	compress->stage.used = 0;
+}
+
+int compress_start(struct compress *compress)
+{
+	int ret;
+
+	/* already started from compress_write() */
+	if (compress->startup.autostarted) {
+		compress->startup.autostarted = 0;
+		return 0;
+	}
+
+	/* staged bytes belong in the prefill */
+	ret = compress_stage_flush(compress);
+	if (ret < 0)
+		return ret;
+
+	/* the flush itself may have reached the fast start threshold */
+	if (compress->startup.autostarted) {
+		compress->startup.autostarted = 0;
+		return 0;
+	}
+
+	ret = compress->ops->start(compress->data);
+	COMPRESS_PROBE2(start, compress, ret);
+	compress_stream_event(compress, TINYTRACE_START, 0, ret);
+	if (!ret) {
+		compress_position_set_running(compress, 1);
+		compress->startup.start_ns = compress_monotonic_ns();
+		compress->startup.first_audio_ns = 0;
+	}
+	return ret;
+}
+
+/*
+ * Estimate when each stream began rendering from its first non zero
+ * timestamp, and return the spread between the earliest and latest.
+ * Returns -1 if some stream did not report progress in time.
+ */
+static long long compress_group_start_skew(struct compress **streams,
+		unsigned int count)
+{
+	struct compress_snapshot snap;
+	unsigned long long start_ns, min = ~0ULL, max = 0;
+	unsigned int i, done = 0, ms;
+	char *measured;
+
+	measured = calloc(count, 1);
+	if (!measured)
+		return -1;
+
+	for (ms = 0; ms < START_GROUP_MEASURE_MS && done < count; ms++) {
+		for (i = 0; i < count; i++) {
+			if (measured[i])
+				continue;
+			if (compress_get_snapshot(streams[i], &snap) < 0 ||
+			    !snap.pcm_io_frames || !snap.sampling_rate)
+				continue;
+
+			start_ns = snap.mono.tv_sec * 1000000000ULL +
+				   snap.mono.tv_nsec -
+				   snap.pcm_io_frames * 1000000000ULL /
+				   snap.sampling_rate;
+			if (start_ns < min)
+				min = start_ns;
+			if (start_ns > max)
+				max = start_ns;
+			measured[i] = 1;
+			done++;
+		}
+		if (done < count)
+			usleep(1000);
+	}
+
+	free(measured);
+	return done == count ? (long long)(max - min) : -1;
+}
+
+void compress_set_start_threshold(struct compress *compress, unsigned int bytes)
+{
+	compress->startup.threshold = bytes;
+}
+
+int compress_get_startup_latency(struct compress *compress,
+		struct compress_startup_latency *latency)
+{
+	struct compress_startup *startup = &compress->startup;
+	struct compress_snapshot snapshot;
+
+	if (!startup->start_ns)
+		return -EAGAIN;
+
+	/* a snapshot dates the first sample once the DSP made progress */
+	if (!startup->first_audio_ns)
+		compress_get_snapshot(compress, &snapshot);
+	if (!startup->first_audio_ns)
+		return -EAGAIN;
+
+	if (!startup->first_write_ns)
+		startup->first_write_ns = startup->start_ns;
+	latency->prefill_ns = startup->start_ns - startup->first_write_ns;
+	latency->start_ns = startup->first_audio_ns - startup->start_ns;
+	latency->total_ns = startup->first_audio_ns - startup->first_write_ns;
+	latency->prefill_bytes = startup->written;
+	return 0;
+}
+
+int compress_start_group(struct compress **streams, unsigned int count,
+		unsigned long long *skew_ns)
+{
+	struct sched_param param, old_param;
+	cpu_set_t cpus, old_cpus;
+	unsigned long long first, last;
+	unsigned int i;
+	long long skew;
+	int policy, pinned, ret = 0;
+
+	if (!count)
+		return -EINVAL;
+
+	/*
+	 * Keep the trigger loop on one CPU at the highest FIFO priority so
+	 * nothing gets scheduled in between the START ioctls. Both are best
+	 * effort, unprivileged callers just get a plain back to back start.
+	 */
+	pinned = !sched_getaffinity(0, sizeof(old_cpus), &old_cpus);
+	if (pinned) {
+		CPU_ZERO(&cpus);
+		CPU_SET(sched_getcpu(), &cpus);
+		pinned = !sched_setaffinity(0, sizeof(cpus), &cpus);
+	}
+	pthread_getschedparam(pthread_self(), &policy, &old_param);
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	first = compress_monotonic_ns();
+	for (i = 0; i < count; i++) {
+		ret = compress_start(streams[i]);
+		if (ret)
+			break;
+	}
+	last = compress_monotonic_ns();
+
+	pthread_setschedparam(pthread_self(), policy, &old_param);
+	if (pinned)
+		sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+
+	if (ret) {
+		while (i--)
+			compress_stop(streams[i]);
+		return ret;
+	}
+
+	if (skew_ns) {
+		skew = compress_group_start_skew(streams, count);
+		*skew_ns = skew >= 0 ? (unsigned long long)skew : last - first;
+	}
+	return 0;
+}
+
+int compress_stop(struct compress *compress)
+{
+	int ret;
+
+	ret = compress->ops->stop(compress->data);
+	COMPRESS_PROBE2(stop, compress, ret);
+	compress_stream_event(compress, TINYTRACE_STOP, 0, ret);
+	if (!ret) {
+		compress_reset_stream_state(compress);
+	}
+	return ret;
+}
+
+int compress_reconfigure(struct compress *compress, struct compr_config *config)
+{
+	int ret;
+
+	if (!COMPRESS_OPS_HAS(compress->ops, reconfigure,
+			      COMPRESS_OPS_F_RECONFIGURE))
+		return -ENOTSUP;
+
+	ret = compress->ops->reconfigure(compress->data, config);
+	compress_stream_event(compress, TINYTRACE_RECONFIGURE, 0, ret);
+	if (!ret) {
+		compress->fragment_size = config->fragment_size;
+		compress->fragments = config->fragments;
+		compress_reset_stream_state(compress);
+
+		if (compress->stage.buf &&
+		    compress->stage.size != compress->fragment_size) {
+			free(compress->stage.buf);
+			compress->stage.buf = NULL;
+			ret = compress_set_write_staging(compress, 1);
+		}
+	}
+	return ret;
+}
+
+static void *compress_preopen_thread(void *data)
+{
+	struct compress_preopen *next = data;
+
+	next->compress = compress_open_by_name(next->name, next->flags,
+					       &next->config);
+	if (!next->compress || !is_compress_ready(next->compress)) {
+		next->ret = -ENODEV;
+		return NULL;
+	}
+
+	if (next->prefill)
+		next->ret = next->prefill(next->compress, next->arg);
+	return NULL;
+}
+
+struct compress_preopen *compress_preopen(const char *name, unsigned int flags,
+		struct compr_config *config,
+		int (*prefill)(struct compress *compress, void *arg), void *arg)
+{
+	struct compress_preopen *next;
+
+	next = calloc(1, sizeof(*next));
+	if (!next)
+		return NULL;
+
+	next->name = strdup(name);
+	if (!next->name)
+		goto name_fail;
+
+	/* the caller's config may be gone by the time the worker runs */
+	next->flags = flags;
+	next->config = *config;
+	if (config->codec) {
+		next->codec = *config->codec;
+		next->config.codec = &next->codec;
+	}
+	next->prefill = prefill;
+	next->arg = arg;
+
+	if (pthread_create(&next->thread, NULL, compress_preopen_thread, next))
+		goto thread_fail;
+	return next;
+
+thread_fail:
+	free(next->name);
+name_fail:
+	free(next);
+	return NULL;
+}
+
+/* wait for the worker and hand out its stream, NULL on failure */
+static struct compress *compress_preopen_finish(struct compress_preopen *next,
+		int *ret)
+{
+	struct compress *compress;
+
+	pthread_join(next->thread, NULL);
+	compress = next->compress;
+	*ret = next->ret;
+	if (*ret && compress) {
+		compress_close(compress);
+		compress = NULL;
+	}
+
+	free(next->name);
+	free(next);
+	return compress;
+}
+
+void compress_preopen_cancel(struct compress_preopen *next)
+{
+	struct compress *compress;
+	int ret;
+
+	compress = compress_preopen_finish(next, &ret);
+	if (compress)
+		compress_close(compress);
+}
+
+int compress_switch_on_drain(struct compress *current,
+		struct compress_preopen *next, struct compress **out)
+{
+	struct compress *compress;
+	int ret;
+
+	ret = compress_drain(current);
+	if (ret) {
+		compress_preopen_cancel(next);
+		return ret;
+	}
+
+	compress = compress_preopen_finish(next, &ret);
+	if (!compress)
+		return ret;
+
+	ret = compress_start(compress);
+	if (ret) {
+		compress_close(compress);
+		return ret;
+	}
+
+	compress_close(current);
+	*out = compress;
+	return 0;
+}
+
+int compress_pause(struct compress *compress)
+{
+	int ret;
+
+	ret = compress->ops->pause(compress->data);
+	compress_stream_event(compress, TINYTRACE_PAUSE, 0, ret);
+	if (!ret)
+		compress_position_set_running(compress, 0);
+	return ret;
+}
+
+int compress_resume(struct compress *compress)
+{
+	int ret;
+
+	ret = compress->ops->resume(compress->data);
+	compress_stream_event(compress, TINYTRACE_RESUME, 0, ret);
+	if (!ret)
+		compress_position_set_running(compress, 1);
+	return ret;
+}
+
+int compress_drain(struct compress *compress)
+{
+	unsigned long long begin;
+	int ret;
+
+	ret = compress_stage_empty(compress);
+	if (ret)
+		return ret;
+
+	/* the compress_start() owed for an auto start is moot now */
+	compress->startup.autostarted = 0;
+
+	begin = compress_monotonic_ns();
+	ret = compress->ops->drain(compress->data);
+	COMPRESS_PROBE2(drain, compress, ret);
+	compress_stream_event(compress, TINYTRACE_DRAIN,
+			      compress_monotonic_ns() - begin, ret);
+	if (!ret)
+		compress_position_set_running(compress, 0);
+	return ret;
+}
+
+int compress_partial_drain(struct compress *compress)
+{
+	unsigned long long begin;
+	int ret;
+
+	ret = compress_stage_empty(compress);
+	if (ret)
+		return ret;
+
+	/* the compress_start() owed for an auto start is moot now */
+	compress->startup.autostarted = 0;
+
+	begin = compress_monotonic_ns();
+	ret = compress->ops->partial_drain(compress->data);
+	COMPRESS_PROBE2(partial_drain, compress, ret);
+	compress_stream_event(compress, TINYTRACE_PARTIAL_DRAIN,
+			      compress_monotonic_ns() - begin, ret);
+	return ret;
+}
+
+static void *compress_drain_thread(void *data)
+{
+	struct compress *compress = data;
+	struct compress_drain *drain = compress->drain;
+	uint64_t one = 1;
+	int ret;
+
+	if (drain->partial)
+		ret = compress_partial_drain(compress);
+	else
+		ret = compress_drain(compress);
+
+	/* the caller may consume the eventfd, waiters go by done */
+	pthread_mutex_lock(&drain->lock);
+	drain->result = ret;
+	drain->done = 1;
+	pthread_cond_broadcast(&drain->cond);
+	pthread_mutex_unlock(&drain->lock);
+
+	if (write(drain->efd, &one, sizeof(one)) < 0) {
+		/* cannot overflow, compress_drain_wait() resets it */
+	}
+	if (drain->cb)
+		drain->cb(compress, drain->result, drain->arg);
+	return NULL;
+}
+
+int compress_drain_async(struct compress *compress, int partial,
+		void (*cb)(struct compress *compress, int ret, void *arg),
+		void *arg)
+{
+	struct compress_drain *drain = compress->drain;
+	pthread_condattr_t attr;
+	int ret;
+
+	if (!drain) {
+		drain = calloc(1, sizeof(*drain));
+		if (!drain)
+			return -ENOMEM;
+		drain->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (drain->efd < 0) {
+			ret = -errno;
+			free(drain);
+			return ret;
+		}
+		pthread_mutex_init(&drain->lock, NULL);
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&drain->cond, &attr);
+		pthread_condattr_destroy(&attr);
+		compress->drain = drain;
+	}
+	if (drain->pending)
+		return -EBUSY;
+
+	drain->done = 0;
+	drain->partial = partial;
+	drain->cb = cb;
+	drain->arg = arg;
+	ret = pthread_create(&drain->thread, NULL, compress_drain_thread,
+			     compress);
+	if (ret)
+		return -ret;
+	drain->pending = 1;
+	return drain->efd;
+}
+
+int compress_drain_wait(struct compress *compress, int timeout_ms)
+{
+	struct compress_drain *drain = compress->drain;
+	struct timespec deadline;
+	uint64_t cnt;
+	int ret = 0, done;
+
+	if (!drain || !drain->pending)
+		return -EINVAL;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&drain->lock);
+	while (!drain->done && ret != ETIMEDOUT) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&drain->cond, &drain->lock);
+		else if (timeout_ms == 0)
+			ret = ETIMEDOUT;
+		else
+			ret = pthread_cond_timedwait(&drain->cond, &drain->lock,
+						     &deadline);
+	}
+	done = drain->done;
+	pthread_mutex_unlock(&drain->lock);
+	if (!done)
+		return -ETIMEDOUT;
+
+	/* the thread kicks the eventfd after done, reset it once joined */
+	pthread_join(drain->thread, NULL);
+	if (read(drain->efd, &cnt, sizeof(cnt)) < 0) {
+		/* already consumed by the caller's own read */
+	}
+	drain->pending = 0;
+	return drain->result;
+}
+
+int compress_drain_timeout(struct compress *compress, int timeout_ms)
+{
+	int ret;
+
+	/* a drain left running by an earlier timeout is waited for again */
+	if (!compress->drain || !compress->drain->pending) {
+		ret = compress_drain_async(compress, 0, NULL, NULL);
+		if (ret < 0)
+			return ret;
+	}
+	return compress_drain_wait(compress, timeout_ms);
+}
+
+int compress_next_track(struct compress *compress)
+{
+	int ret;
+
+	/* the last bytes of this track go before the boundary */
+	ret = compress_stage_empty(compress);
+	if (ret)
+		return ret;
+
+	ret = compress->ops->next_track(compress->data);
+	compress_stream_event(compress, TINYTRACE_NEXT_TRACK, 0, ret);
+	return ret;
+}
+
+int compress_set_gapless_metadata(struct compress *compress,
+	struct compr_gapless_mdata *mdata)
+{
+	return compress->ops->set_gapless_metadata(compress->data, mdata);
+}
+
+int compress_queue_next_track(struct compress *compress,
+	struct snd_codec *codec, struct compr_gapless_mdata *mdata)
+{
+	int ret;
+
+	ret = compress_stage_empty(compress);
+	if (ret)
+		return ret;
+
+	if (COMPRESS_OPS_HAS(compress->ops, queue_next_track,
+			     COMPRESS_OPS_F_QUEUE_NEXT_TRACK))
+		return compress->ops->queue_next_track(compress->data, codec, mdata);
+
+	ret = compress->ops->set_gapless_metadata(compress->data, mdata);
+	if (ret)
+		return ret;
+	ret = compress->ops->next_track(compress->data);
+	if (ret)
+		return ret;
+	if (codec)
+		ret = compress->ops->set_codec_params(compress->data, codec);
+	return ret;
+}
+
+int compress_get_metadata(struct compress *compress,
+	struct compr_gapless_mdata *mdata)
+{
+	if (!COMPRESS_OPS_HAS(compress->ops, get_metadata, COMPRESS_OPS_F_READBACK))
+		return -ENOTSUP;
+
+	return compress->ops->get_metadata(compress->data, mdata);
+}
+
+int compress_get_codec_params(struct compress *compress, struct snd_codec *codec)
+{
+	if (!COMPRESS_OPS_HAS(compress->ops, get_codec_params,
+			      COMPRESS_OPS_F_READBACK))
+		return -ENOTSUP;
+
+	return compress->ops->get_codec_params(compress->data, codec);
+}
+
+bool is_codec_supported(unsigned int card, unsigned int device,
+		unsigned int flags, struct snd_codec *codec)
+{
+	struct compress_ops *ops = &compress_hw_ops;
+	char name[128];
+
+	snprintf(name, sizeof(name), "hw:%u,%u", card, device);
+
+	return ops->is_codec_supported_by_name(name, flags, codec);
+}
+
+bool is_codec_supported_by_name(const char *name,
+		unsigned int flags, struct snd_codec *codec)
+{
+	struct compress *compress;
+	bool ret;
+
+	compress = calloc(1, sizeof(struct compress));
+	if (!compress)
+		return false;
+
+	if (!strncmp(name, "hw:", 3)) {
+		compress->ops = &compress_hw_ops;
+	} else {
+		if (populate_compress_plugin_ops(compress, name)) {
+			free(compress);
+			return NULL;
+		}
+	}
+
+	ret = compress->ops->is_codec_supported_by_name(name, flags, codec);
+
+	if (compress->dl_hdl)
+		dlclose(compress->dl_hdl);
+	free(compress);
+
+	return ret;
+}
+
+int compress_get_position(struct compress *compress,
+		unsigned long long *samples, unsigned int *sampling_rate)
+{
+	struct compress_position *pos = &compress->pos;
+	unsigned long long now, elapsed, position;
+	int ret;
+
+	now = compress_monotonic_ns();
+	elapsed = now - pos->time_ns;
+
+	if (!pos->valid || (pos->running && elapsed >= pos->interval_ns)) {
+		ret = compress_query_tstamp(compress, &pos->samples,
+					    &pos->sampling_rate, &pos->time_ns);
+		if (ret < 0)
+			return ret;
+		pos->valid = 1;
+		now = compress_monotonic_ns();
+		elapsed = now - pos->time_ns;
+	}
+
+	position = pos->samples;
+	if (pos->running && pos->sampling_rate)
+		position += elapsed * pos->sampling_rate / 1000000000ULL;
+
+	/*
+	 * Extrapolation may run slightly ahead of the DSP, so a fresh
+	 * snapshot can land behind what was already reported. Hold the
+	 * position instead of going backwards, unless it is further
+	 * behind than one interval can explain, i.e. the counter was reset.
+	 */
+	if (position < pos->reported && pos->sampling_rate &&
+	    pos->reported - position <=
+	    pos->interval_ns * pos->sampling_rate / 1000000000ULL)
+		position = pos->reported;
+
+	pos->reported = position;
+	*samples = position;
+	*sampling_rate = pos->sampling_rate;
+	return 0;
+}
+
+int compress_get_media_clock(struct compress *compress,
+		struct compress_media_clock *mclock)
+{
+	struct media_clock *clock = &compress->clock;
+	unsigned long long now, x0, y0, samples, mono_ns;
+	double x, y, mean_x = 0, mean_y = 0, sxx = 0, sxy = 0, ratio;
+	unsigned int i, idx, rate;
+	int ret;
+
+	now = compress_monotonic_ns();
+
+	/* feed a new pair when the newest one is older than one interval */
+	idx = (clock->head + MEDIA_CLOCK_POINTS - 1) % MEDIA_CLOCK_POINTS;
+	if (!clock->count || now - clock->mono_ns[idx] >= compress->pos.interval_ns) {
+		ret = compress_query_tstamp(compress, &samples, &rate, &mono_ns);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (clock->count < 2)
+		return -EAGAIN;
+
+	/* fit relative to the oldest pair to keep the doubles precise */
+	idx = (clock->head + MEDIA_CLOCK_POINTS - clock->count) % MEDIA_CLOCK_POINTS;
+	x0 = clock->mono_ns[idx];
+	y0 = clock->media_ns[idx];
+
+	for (i = 0; i < clock->count; i++) {
+		idx = (clock->head + MEDIA_CLOCK_POINTS - clock->count + i) %
+			MEDIA_CLOCK_POINTS;
+		mean_x += clock->mono_ns[idx] - x0;
+		mean_y += clock->media_ns[idx] - y0;
+	}
+	mean_x /= clock->count;
+	mean_y /= clock->count;
+
+	for (i = 0; i < clock->count; i++) {
+		idx = (clock->head + MEDIA_CLOCK_POINTS - clock->count + i) %
+			MEDIA_CLOCK_POINTS;
+		x = clock->mono_ns[idx] - x0 - mean_x;
+		y = clock->media_ns[idx] - y0 - mean_y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+	if (sxx <= 0)
+		return -EAGAIN;
+	ratio = sxy / sxx;
+
+	y = mean_y + ratio * ((double)(now - x0) - mean_x);
+	mclock->mono_ns = now;
+	mclock->media_ns = y0 + (y > 0 ? (unsigned long long)y : 0);
+	mclock->rate_ratio = ratio;
+	mclock->points = clock->count;
+	return 0;
+}
+
+void compress_set_position_interval(struct compress *compress, int milliseconds)
+{
+	compress->pos.interval_ns = milliseconds > 0 ?
+		milliseconds * 1000000ULL : 0;
+	compress->pos.valid = 0;
+}
+
+void compress_set_max_poll_wait(struct compress *compress, int milliseconds)
+{
+	compress->ops->set_max_poll_wait(compress->data, milliseconds);
+}
+
+int compress_set_adaptive_poll(struct compress *compress, int enable)
+{
+	if (!COMPRESS_OPS_HAS(compress->ops, set_adaptive_poll,
+			      COMPRESS_OPS_F_ADAPTIVE_POLL))
+		return -ENOTSUP;
+
+	return compress->ops->set_adaptive_poll(compress->data, enable);
+}
+
+static void compress_low_watermark_notify(void *arg,
+		unsigned long long queued_us)
+{
+	struct compress *compress = arg;
+
+	compress->lwm_cb(compress, queued_us, compress->lwm_arg);
+}
+
+int compress_set_low_watermark(struct compress *compress,
+		unsigned int threshold_us,
+		void (*cb)(struct compress *compress,
+			   unsigned long long queued_us, void *arg),
+		void *arg)
+{
+	if (!COMPRESS_OPS_HAS(compress->ops, set_low_watermark,
+			      COMPRESS_OPS_F_LOW_WATERMARK))
+		return -ENOTSUP;
+
+	compress->lwm_cb = cb;
+	compress->lwm_arg = arg;
+	return compress->ops->set_low_watermark(compress->data, threshold_us,
+			cb ? compress_low_watermark_notify : NULL, compress);
+}
+
+void compress_nonblock(struct compress *compress, int nonblock)
+{
+	compress->ops->set_nonblock(compress->data, nonblock);
+}
+
+int compress_wait(struct compress *compress, int timeout_ms)
+{
+	return compress->ops->wait(compress->data, timeout_ms);
+}
+
+int compress_set_codec_params(struct compress *compress, struct snd_codec *codec)
+{
+	return compress->ops->set_codec_params(compress->data, codec);
+}
+
+int compress_get_poll_fd(struct compress *compress)
+{
+	if (!COMPRESS_OPS_HAS(compress->ops, get_poll_fd, COMPRESS_OPS_F_POLL_FD))
+		return -ENOTSUP;
+
+	return compress->ops->get_poll_fd(compress->data);
+}
+
+int compress_get_caps(struct compress *compress, struct snd_compr_caps *caps)
+{
+	if (!COMPRESS_OPS_HAS(compress->ops, get_caps, COMPRESS_OPS_F_CAPS))
+		return -ENOTSUP;
+
+	return compress->ops->get_caps(compress->data, caps);
+}
+
+/* kept in the page right in front of a compress_alloc_buffer() buffer */
+struct compress_buffer_header {
+	size_t map_len;		/* header page included */
+};
+
+void *compress_alloc_buffer(struct compress *compress, unsigned int flags)
+{
+	struct compress_buffer_header *hdr;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t align = page, size, map_len;
+	char *map, *buf, *end;
+
+	size = (size_t)compress->fragment_size * compress->fragments;
+	if (!size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/*
+	 * Transparent huge pages only back whole, aligned huge pages of a
+	 * region, so round the buffer up to those and map enough to slide
+	 * it onto the alignment, then trim the slack.
+	 */
+	if (flags & COMPRESS_BUFFER_HUGEPAGE)
+		align = COMPRESS_HUGEPAGE_SIZE;
+	size = (size + align - 1) & ~(align - 1);
+
+	map_len = page + size + (align - page);
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	buf = (char *)(((uintptr_t)map + page + align - 1) & ~(align - 1));
+	end = buf + size;
+	if (buf - page > map)
+		munmap(map, buf - page - map);
+	if (end < map + map_len)
+		munmap(end, map + map_len - end);
+
+	if (flags & COMPRESS_BUFFER_HUGEPAGE)
+		madvise(buf, size, MADV_HUGEPAGE);
+
+	hdr = (struct compress_buffer_header *)(buf - page);
+	hdr->map_len = page + size;
+
+	/* fault everything in now rather than on the first write */
+	if (!(flags & COMPRESS_BUFFER_MLOCK) || mlock(buf, size))
+		memset(buf, 0, size);
+	return buf;
+}
+
+void compress_free_buffer(void *buffer)
+{
+	struct compress_buffer_header *hdr;
+
+	if (!buffer)
+		return;
+
+	hdr = (struct compress_buffer_header *)
+		((char *)buffer - sysconf(_SC_PAGESIZE));
+	munmap(hdr, hdr->map_len);
+}
+
+int compress_get_stats(struct compress *compress, struct compress_stats *stats)
+{
+	const struct compress_stats *own = &compress->stats;
+	int ret;
+
+	memset(stats, 0, sizeof(*stats));
+	if (COMPRESS_OPS_HAS(compress->ops, get_stats, COMPRESS_OPS_F_STATS)) {
+		ret = compress->ops->get_stats(compress->data, stats);
+		if (ret)
+			return ret;
+	}
+
+	stats->bytes = __atomic_load_n(&own->bytes, __ATOMIC_RELAXED);
+	stats->transfers = __atomic_load_n(&own->transfers, __ATOMIC_RELAXED);
+	stats->partial_transfers = __atomic_load_n(&own->partial_transfers,
+						   __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&own->errors, __ATOMIC_RELAXED);
+	stats->drains = __atomic_load_n(&own->drains, __ATOMIC_RELAXED);
+	stats->drain_ns = __atomic_load_n(&own->drain_ns, __ATOMIC_RELAXED);
+	stats->drain_max_ns = __atomic_load_n(&own->drain_max_ns,
+					      __ATOMIC_RELAXED);
+	return 0;
 }
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Table of the plugins linked into libtinycompress.
+ *
+ * compress.c refers to this table, which refers to every bundled plugin,
+ * so a static link keeps them even though nothing else calls into them.
+ */
+
+#include <stddef.h>
+#include "tinycompress/compress_ops.h"
+
+#define HIDDEN	__attribute__((visibility("hidden")))
+
+extern struct compress_plugin compress_plugin_tee HIDDEN;
+extern struct compress_plugin compress_plugin_shm HIDDEN;
+
+HIDDEN struct compress_plugin *const compress_builtin_plugins[] = {
+	&compress_plugin_tee,
+	&compress_plugin_shm,
+	NULL,
+};
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * On-disk cache of the caps of the hw compress nodes.
+ *
+ * Reading the caps means opening the node and issuing ioctls, which some
+ * drivers make slow. With TINYCOMPRESS_CACHE_DIR set the result is kept
+ * in one file per node, so a restarted process can skip the probe.
+ *
+ * An entry is only used while its key still matches the system: the
+ * running kernel, the id and driver of the card in sysfs, and the device
+ * number and change time of the node itself, which are new whenever the
+ * driver binds again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <sound/asound.h>
+#include "sound/compress_params.h"
+#include "sound/compress_offload.h"
+#include "compress_cache.h"
+
+#define COMPRESS_CACHE_MAGIC	0x43434143	/* "CACC" */
+#define COMPRESS_CACHE_ID_LEN	65
+
+struct compress_cache_key {
+	char release[COMPRESS_CACHE_ID_LEN];
+	char kversion[COMPRESS_CACHE_ID_LEN];
+	char card_id[COMPRESS_CACHE_ID_LEN];
+	char driver[COMPRESS_CACHE_ID_LEN];
+	unsigned long long rdev;
+	long long ctime_sec;
+	long long ctime_nsec;
+};
+
+struct compress_cache_entry {
+	unsigned int magic;
+	unsigned int size;
+	struct compress_cache_key key;
+	int version;
+	struct snd_compr_caps caps;
+};
+
+static const char *compress_cache_dir(void)
+{
+	const char *dir = getenv("TINYCOMPRESS_CACHE_DIR");
+
+	return dir && *dir ? dir : NULL;
+}
+
+static void compress_cache_read_id(const char *path, char *buf)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	len = read(fd, buf, COMPRESS_CACHE_ID_LEN - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+}
+
+static int compress_cache_make_key(unsigned int card, unsigned int device,
+		struct compress_cache_key *key)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	struct utsname uts;
+	struct stat st;
+	const char *driver;
+	ssize_t len;
+
+	/* the key is compared as a whole, so padding must be zero too */
+	memset(key, 0, sizeof(*key));
+
+	snprintf(path, sizeof(path), "/dev/snd/comprC%uD%u", card, device);
+	if (stat(path, &st))
+		return -errno;
+	key->rdev = st.st_rdev;
+	key->ctime_sec = st.st_ctim.tv_sec;
+	key->ctime_nsec = st.st_ctim.tv_nsec;
+
+	if (uname(&uts))
+		return -errno;
+	snprintf(key->release, sizeof(key->release), "%s", uts.release);
+	snprintf(key->kversion, sizeof(key->kversion), "%s", uts.version);
+
+	snprintf(path, sizeof(path), "/sys/class/sound/card%u/id", card);
+	compress_cache_read_id(path, key->card_id);
+
+	snprintf(path, sizeof(path), "/sys/class/sound/card%u/device/driver",
+		 card);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = '\0';
+		driver = strrchr(link, '/');
+		snprintf(key->driver, sizeof(key->driver), "%.*s",
+			 COMPRESS_CACHE_ID_LEN - 1, driver ? driver + 1 : link);
+	}
+	return 0;
+}
+
+int compress_caps_cache_get(unsigned int card, unsigned int device,
+		int *version, struct snd_compr_caps *caps)
+{
+	struct compress_cache_entry entry;
+	struct compress_cache_key key;
+	const char *dir = compress_cache_dir();
+	char fn[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	if (!dir)
+		return -ENOENT;
+	if (compress_cache_make_key(card, device, &key))
+		return -ENOENT;
+
+	snprintf(fn, sizeof(fn), "%s/caps-C%uD%u", dir, card, device);
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, &entry, sizeof(entry));
+	close(fd);
+
+	if (len != sizeof(entry) || entry.magic != COMPRESS_CACHE_MAGIC ||
+	    entry.size != sizeof(entry) ||
+	    memcmp(&entry.key, &key, sizeof(key)))
+		return -ESTALE;
+
+	/* anyone able to write the cache dir controls the file, check it */
+	if (entry.caps.num_codecs > MAX_NUM_CODECS ||
+	    (entry.caps.direction != SND_COMPRESS_PLAYBACK &&
+	     entry.caps.direction != SND_COMPRESS_CAPTURE) ||
+	    entry.caps.min_fragment_size > entry.caps.max_fragment_size ||
+	    entry.caps.min_fragments > entry.caps.max_fragments)
+		return -ESTALE;
+
+	if (version)
+		*version = entry.version;
+	memcpy(caps, &entry.caps, sizeof(*caps));
+	return 0;
+}
+
+void compress_caps_cache_put(unsigned int card, unsigned int device,
+		int version, const struct snd_compr_caps *caps)
+{
+	struct compress_cache_entry entry;
+	const char *dir = compress_cache_dir();
+	char fn[PATH_MAX], tmp[PATH_MAX];
+	int fd, ok;
+
+	if (!dir)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	if (compress_cache_make_key(card, device, &entry.key))
+		return;
+	entry.magic = COMPRESS_CACHE_MAGIC;
+	entry.size = sizeof(entry);
+	entry.version = version;
+	memcpy(&entry.caps, caps, sizeof(entry.caps));
+
+	/* write aside and rename, so readers never see a partial entry */
+	snprintf(fn, sizeof(fn), "%s/caps-C%uD%u", dir, card, device);
+	snprintf(tmp, sizeof(tmp), "%s/caps-C%uD%u.XXXXXX",
+		 dir, card, device);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	ok = write(fd, &entry, sizeof(entry)) == sizeof(entry);
+	close(fd);
+	if (!ok || rename(tmp, fn))
+		unlink(tmp);
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * On-disk cache of the caps of the hw compress nodes, enabled by pointing
+ * TINYCOMPRESS_CACHE_DIR to a writable directory, e.g. below /run.
+ */
+
+#ifndef __COMPRESS_CACHE_H
+#define __COMPRESS_CACHE_H
+
+struct snd_compr_caps;
+
+/*
+ * compress_caps_cache_get: look up the caps of a node
+ * returns 0 when a valid entry was found, negative otherwise
+ *
+ * @card: sound card number
+ * @device: device number
+ * @version: returned ioctl protocol version of the node, may be NULL
+ * @caps: returned caps
+ */
+int compress_caps_cache_get(unsigned int card, unsigned int device,
+		int *version, struct snd_compr_caps *caps);
+
+/*
+ * compress_caps_cache_put: store the caps of a node, errors are ignored
+ *
+ * @card: sound card number
+ * @device: device number
+ * @version: ioctl protocol version reported by the node
+ * @caps: caps reported by the node
+ */
+void compress_caps_cache_put(unsigned int card, unsigned int device,
+		int version, const struct snd_compr_caps *caps);
+
+#endif
@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Discovery of the compress nodes present in /dev/snd.
+ *
+ * Every node has to be opened to read its caps, which may take a while
+ * on some drivers, so the nodes are probed in parallel by a few worker
+ * threads. The table is cached and only rebuilt when /dev/snd changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <sound/asound.h>
+#include "sound/compress_params.h"
+#include "sound/compress_offload.h"
+#include "tinycompress/tinycompress.h"
+#include "compress_cache.h"
+
+#define COMPRESS_DEV_DIR	"/dev/snd"
+#define COMPRESS_ENUM_THREADS	4
+
+struct compress_enum_probe {
+	struct compress_device_info *devices;
+	unsigned int count;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct compress_device_info *devices;
+	unsigned int count;
+	struct timespec mtime;		/* of COMPRESS_DEV_DIR when scanned */
+	int valid;
+} compress_enum_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void compress_enum_probe_one(struct compress_device_info *info)
+{
+	struct snd_compr_caps caps;
+	char fn[256];
+	unsigned int i;
+	int fd, version;
+
+	if (!compress_caps_cache_get(info->card, info->device, NULL, &caps))
+		goto fill;
+
+	snprintf(fn, sizeof(fn), COMPRESS_DEV_DIR "/comprC%uD%u",
+		 info->card, info->device);
+
+	/* the kernel refuses an open against the node's direction */
+	fd = open(fn, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		info->error = -errno;
+		return;
+	}
+
+	if (ioctl(fd, SNDRV_COMPRESS_IOCTL_VERSION, &version) ||
+	    ioctl(fd, SNDRV_COMPRESS_GET_CAPS, &caps)) {
+		info->error = -errno;
+		close(fd);
+		return;
+	}
+	close(fd);
+	compress_caps_cache_put(info->card, info->device, version, &caps);
+
+fill:
+	info->direction = caps.direction;
+	info->min_fragment_size = caps.min_fragment_size;
+	info->max_fragment_size = caps.max_fragment_size;
+	info->min_fragments = caps.min_fragments;
+	info->max_fragments = caps.max_fragments;
+	info->num_codecs = caps.num_codecs;
+	if (info->num_codecs > COMPRESS_ENUM_MAX_CODECS)
+		info->num_codecs = COMPRESS_ENUM_MAX_CODECS;
+	for (i = 0; i < info->num_codecs; i++)
+		info->codecs[i] = caps.codecs[i];
+}
+
+/* a node held by another process may be free again on the next call */
+static bool compress_enum_transient(int error)
+{
+	return error == -EBUSY || error == -EAGAIN;
+}
+
+static void *compress_enum_worker(void *data)
+{
+	struct compress_enum_probe *probe = data;
+	unsigned int idx;
+
+	for (;;) {
+		pthread_mutex_lock(&probe->lock);
+		idx = probe->next++;
+		pthread_mutex_unlock(&probe->lock);
+		if (idx >= probe->count)
+			break;
+		compress_enum_probe_one(&probe->devices[idx]);
+	}
+	return NULL;
+}
+
+static int compress_enum_cmp(const void *a, const void *b)
+{
+	const struct compress_device_info *da = a, *db = b;
+
+	if (da->card != db->card)
+		return da->card < db->card ? -1 : 1;
+	if (da->device != db->device)
+		return da->device < db->device ? -1 : 1;
+	return 0;
+}
+
+/* list the nodes in COMPRESS_DEV_DIR, returns the count or negative */
+static int compress_enum_scan(struct compress_device_info **devices)
+{
+	struct compress_device_info *list = NULL, *tmp;
+	unsigned int count = 0, size = 0, card, device;
+	struct dirent *dent;
+	char extra;
+	DIR *dir;
+
+	dir = opendir(COMPRESS_DEV_DIR);
+	if (!dir)
+		return errno == ENOENT ? 0 : -errno;
+
+	while ((dent = readdir(dir))) {
+		if (sscanf(dent->d_name, "comprC%uD%u%c",
+			   &card, &device, &extra) != 2)
+			continue;
+
+		if (count == size) {
+			size = size ? size * 2 : 16;
+			tmp = realloc(list, size * sizeof(*list));
+			if (!tmp) {
+				closedir(dir);
+				free(list);
+				return -ENOMEM;
+			}
+			list = tmp;
+		}
+		memset(&list[count], 0, sizeof(*list));
+		list[count].card = card;
+		list[count].device = device;
+		count++;
+	}
+	closedir(dir);
+
+	qsort(list, count, sizeof(*list), compress_enum_cmp);
+	*devices = list;
+	return count;
+}
+
+static int compress_enum_probe_all(struct compress_device_info *devices,
+		unsigned int count)
+{
+	struct compress_enum_probe probe = {
+		.devices = devices,
+		.count = count,
+	};
+	pthread_t threads[COMPRESS_ENUM_THREADS];
+	unsigned int i, nthreads;
+
+	nthreads = count < COMPRESS_ENUM_THREADS ? count : COMPRESS_ENUM_THREADS;
+	pthread_mutex_init(&probe.lock, NULL);
+
+	/* the calling thread probes too, so one node needs no thread */
+	for (i = 0; i + 1 < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, compress_enum_worker, &probe))
+			break;
+	nthreads = i;
+
+	compress_enum_worker(&probe);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&probe.lock);
+	return 0;
+}
+
+int compress_enumerate(struct compress_device_info **devices, unsigned int flags)
+{
+	struct compress_device_info *list = NULL;
+	struct stat st;
+	unsigned int i;
+	int ret;
+
+	*devices = NULL;
+
+	pthread_mutex_lock(&compress_enum_cache.lock);
+
+	if (stat(COMPRESS_DEV_DIR, &st))
+		memset(&st, 0, sizeof(st));
+
+	if (!(flags & COMPRESS_ENUM_RESCAN) && compress_enum_cache.valid &&
+	    st.st_mtim.tv_sec == compress_enum_cache.mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == compress_enum_cache.mtime.tv_nsec) {
+		for (i = 0; i < compress_enum_cache.count; i++) {
+			list = &compress_enum_cache.devices[i];
+			if (compress_enum_transient(list->error)) {
+				list->error = 0;
+				compress_enum_probe_one(list);
+			}
+		}
+		goto copy;
+	}
+
+	ret = compress_enum_scan(&list);
+	if (ret < 0)
+		goto unlock;
+	compress_enum_probe_all(list, ret);
+
+	free(compress_enum_cache.devices);
+	compress_enum_cache.devices = list;
+	compress_enum_cache.count = ret;
+	compress_enum_cache.mtime = st.st_mtim;
+	compress_enum_cache.valid = 1;
+
+copy:
+	ret = compress_enum_cache.count;
+	if (ret) {
+		*devices = malloc(ret * sizeof(**devices));
+		if (*devices)
+			memcpy(*devices, compress_enum_cache.devices,
+			       ret * sizeof(**devices));
+		else
+			ret = -ENOMEM;
+	}
+unlock:
+	pthread_mutex_unlock(&compress_enum_cache.lock);
+	return ret;
+}
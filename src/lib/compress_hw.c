@@ -14,7 +14,9 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <limits.h>
+#include <sys/uio.h>
 
 #include <linux/types.h>
 #include <linux/ioctl.h>
@@ -26,23 +28,46 @@
 #include "sound/compress_offload.h"
 #include "tinycompress/tinycompress.h"
 #include "tinycompress/compress_ops.h"
+#include "compress_cache.h"
+#include "compress_probes.h"
+#include "compress_trace.h"
 
 #define COMPR_ERR_MAX 128
+#define COMPR_IOV_MAX 64
 
 /* Default maximum time we will wait in a poll() - 20 seconds */
 #define DEFAULT_MAX_POLL_WAIT_MS    20000
 
+struct compress_hw_proto;
+
 struct compress_hw_data {
 	int fd;
 	unsigned int flags;
+	unsigned int card;
+	unsigned int device;
 	char error[COMPR_ERR_MAX];
 	int ioctl_version;
+	const struct compress_hw_proto *proto;
 	struct compr_config *config;
+	struct snd_compr_caps caps;
 	int running;
 	int max_poll_wait_ms;
+	int adaptive_poll;
 	int nonblocking;
 	unsigned int gapless_metadata;
 	unsigned int next_track;
+	struct snd_codec params;	/* codec config last set on the device */
+	struct snd_codec codec;		/* cached GET_PARAMS readback */
+	unsigned int codec_valid;
+	struct compr_gapless_mdata mdata;	/* cached GET_METADATA readback */
+	unsigned int mdata_valid;
+	struct compress_trace *trace;	/* flight recorder, owned by the stream */
+	unsigned long long poll_timeouts;
+	unsigned long long underrun_risk;
+	unsigned int lwm_us;		/* low watermark, 0 for one fragment */
+	int lwm_armed;
+	void (*lwm_notify)(void *arg, unsigned long long queued_us);
+	void *lwm_arg;
 };
 
 static int oops(struct compress_hw_data *compress, int e, const char *fmt, ...)
@@ -87,24 +112,14 @@ static int is_compress_hw_ready(void *data)
 	return (compress->fd > 0) ? 1 : 0;
 }
 
-static int get_compress_hw_version(struct compress_hw_data *compress)
-{
-	return compress->ioctl_version;
-}
-
-static bool _is_codec_type_supported(int fd, struct snd_codec *codec)
+static bool _is_codec_type_supported(struct snd_compr_caps *caps,
+		struct snd_codec *codec)
 {
-	struct snd_compr_caps caps;
 	bool found = false;
 	unsigned int i;
 
-	if (ioctl(fd, SNDRV_COMPRESS_GET_CAPS, &caps)) {
-		oops(&bad_compress, errno, "cannot get device caps");
-		return false;
-	}
-
-	for (i = 0; i < caps.num_codecs; i++) {
-		if (caps.codecs[i] == codec->id) {
+	for (i = 0; i < caps->num_codecs; i++) {
+		if (caps->codecs[i] == codec->id) {
 			/* found the codec */
 			found = true;
 			break;
@@ -114,6 +129,153 @@ static bool _is_codec_type_supported(int fd, struct snd_codec *codec)
 	return found;
 }
 
+/*
+ * Ioctls whose form depends on the kernel protocol version. The table
+ * matching the running kernel is picked once at open, so the calls
+ * below need no version checks.
+ */
+struct compress_hw_proto {
+	bool gapless;
+	int (*avail)(struct compress_hw_data *compress,
+			struct snd_compr_avail64 *avail);
+	int (*tstamp)(struct compress_hw_data *compress,
+			unsigned long long *samples, unsigned int *sampling_rate);
+	int (*set_metadata)(struct compress_hw_data *compress,
+			struct compr_gapless_mdata *mdata);
+	int (*get_metadata)(struct compress_hw_data *compress,
+			struct compr_gapless_mdata *mdata);
+};
+
+static int compress_hw_avail_32(struct compress_hw_data *compress,
+		struct snd_compr_avail64 *avail64)
+{
+	struct snd_compr_avail avail32;
+
+	if (ioctl(compress->fd, SNDRV_COMPRESS_AVAIL, &avail32))
+		return oops(compress, errno, "cannot get avail");
+
+	avail64->avail = avail32.avail;
+	avail64->tstamp.byte_offset = avail32.tstamp.byte_offset;
+	avail64->tstamp.copied_total = avail32.tstamp.copied_total;
+	avail64->tstamp.pcm_frames = avail32.tstamp.pcm_frames;
+	avail64->tstamp.pcm_io_frames = avail32.tstamp.pcm_io_frames;
+	avail64->tstamp.sampling_rate = avail32.tstamp.sampling_rate;
+	return 0;
+}
+
+static int compress_hw_avail_64(struct compress_hw_data *compress,
+		struct snd_compr_avail64 *avail64)
+{
+	if (ioctl(compress->fd, SNDRV_COMPRESS_AVAIL64, avail64))
+		return oops(compress, errno, "cannot get avail64");
+	return 0;
+}
+
+static int compress_hw_tstamp_32(struct compress_hw_data *compress,
+		unsigned long long *samples, unsigned int *sampling_rate)
+{
+	struct snd_compr_tstamp ktstamp;
+
+	if (ioctl(compress->fd, SNDRV_COMPRESS_TSTAMP, &ktstamp))
+		return oops(compress, errno, "cannot get tstamp");
+
+	*samples = ktstamp.pcm_io_frames;
+	*sampling_rate = ktstamp.sampling_rate;
+	return 0;
+}
+
+static int compress_hw_tstamp_64(struct compress_hw_data *compress,
+		unsigned long long *samples, unsigned int *sampling_rate)
+{
+	struct snd_compr_tstamp64 ktstamp;
+
+	if (ioctl(compress->fd, SNDRV_COMPRESS_TSTAMP64, &ktstamp))
+		return oops(compress, errno, "cannot get tstamp64");
+
+	*samples = ktstamp.pcm_io_frames;
+	*sampling_rate = ktstamp.sampling_rate;
+	return 0;
+}
+
+static int compress_hw_metadata_none(struct compress_hw_data *compress,
+		struct compr_gapless_mdata *mdata)
+{
+	(void)mdata;
+	return oops(compress, ENXIO, "gapless apis not supported in kernel");
+}
+
+static int compress_hw_set_metadata(struct compress_hw_data *compress,
+		struct compr_gapless_mdata *mdata)
+{
+	struct snd_compr_metadata metadata;
+
+	metadata.key = SNDRV_COMPRESS_ENCODER_PADDING;
+	metadata.value[0] = mdata->encoder_padding;
+	if (ioctl(compress->fd, SNDRV_COMPRESS_SET_METADATA, &metadata))
+		return oops(compress, errno, "can't set metadata for stream\n");
+
+	metadata.key = SNDRV_COMPRESS_ENCODER_DELAY;
+	metadata.value[0] = mdata->encoder_delay;
+	if (ioctl(compress->fd, SNDRV_COMPRESS_SET_METADATA, &metadata))
+		return oops(compress, errno, "can't set metadata for stream\n");
+	return 0;
+}
+
+static int compress_hw_get_metadata_ioctl(struct compress_hw_data *compress,
+		struct compr_gapless_mdata *mdata)
+{
+	struct snd_compr_metadata metadata;
+
+	memset(&metadata, 0, sizeof(metadata));
+	metadata.key = SNDRV_COMPRESS_ENCODER_PADDING;
+	if (ioctl(compress->fd, SNDRV_COMPRESS_GET_METADATA, &metadata))
+		return oops(compress, errno, "can't get metadata for stream");
+	mdata->encoder_padding = metadata.value[0];
+
+	memset(&metadata, 0, sizeof(metadata));
+	metadata.key = SNDRV_COMPRESS_ENCODER_DELAY;
+	if (ioctl(compress->fd, SNDRV_COMPRESS_GET_METADATA, &metadata))
+		return oops(compress, errno, "can't get metadata for stream");
+	mdata->encoder_delay = metadata.value[0];
+	return 0;
+}
+
+/* before 0.1.1: no gapless metadata */
+static const struct compress_hw_proto compress_hw_proto_0_1_0 = {
+	.gapless = false,
+	.avail = compress_hw_avail_32,
+	.tstamp = compress_hw_tstamp_32,
+	.set_metadata = compress_hw_metadata_none,
+	.get_metadata = compress_hw_metadata_none,
+};
+
+/* 0.1.1 up to 0.4.0: gapless, 32 bit counters */
+static const struct compress_hw_proto compress_hw_proto_0_1_1 = {
+	.gapless = true,
+	.avail = compress_hw_avail_32,
+	.tstamp = compress_hw_tstamp_32,
+	.set_metadata = compress_hw_set_metadata,
+	.get_metadata = compress_hw_get_metadata_ioctl,
+};
+
+/* 0.4.0 and later: 64 bit counters */
+static const struct compress_hw_proto compress_hw_proto_0_4_0 = {
+	.gapless = true,
+	.avail = compress_hw_avail_64,
+	.tstamp = compress_hw_tstamp_64,
+	.set_metadata = compress_hw_set_metadata,
+	.get_metadata = compress_hw_get_metadata_ioctl,
+};
+
+static const struct compress_hw_proto *compress_hw_pick_proto(int version)
+{
+	if (version >= SNDRV_PROTOCOL_VERSION(0, 4, 0))
+		return &compress_hw_proto_0_4_0;
+	if (version >= SNDRV_PROTOCOL_VERSION(0, 1, 1))
+		return &compress_hw_proto_0_1_1;
+	return &compress_hw_proto_0_1_0;
+}
+
 static inline void
 fill_compress_hw_params(struct compr_config *config, struct snd_compr_params *params)
 {
@@ -129,6 +291,7 @@ static void *compress_hw_open_by_name(const char *name,
 	struct snd_compr_params params;
 	struct snd_compr_caps caps;
 	unsigned int card, device;
+	int version;
 	char fn[256];
 
 	if (!config) {
@@ -149,6 +312,8 @@ static void *compress_hw_open_by_name(const char *name,
 
 	compress->next_track = 0;
 	compress->gapless_metadata = 0;
+	compress->card = card;
+	compress->device = device;
 	compress->config = calloc(1, sizeof(*config));
 	if (!compress->config)
 		goto input_fail;
@@ -182,11 +347,18 @@ static void *compress_hw_open_by_name(const char *name,
 		oops(&bad_compress, EPROTO, "invalid protocol version number");
 		goto codec_fail;
 	}
+	compress->proto = compress_hw_pick_proto(compress->ioctl_version);
 
-	if (ioctl(compress->fd, SNDRV_COMPRESS_GET_CAPS, &caps)) {
-		oops(compress, errno, "cannot get device caps");
-		goto codec_fail;
+	if (compress_caps_cache_get(card, device, &version, &caps) ||
+	    version != compress->ioctl_version) {
+		if (ioctl(compress->fd, SNDRV_COMPRESS_GET_CAPS, &caps)) {
+			oops(compress, errno, "cannot get device caps");
+			goto codec_fail;
+		}
+		compress_caps_cache_put(card, device, compress->ioctl_version,
+					&caps);
 	}
+	memcpy(&compress->caps, &caps, sizeof(caps));
 
 	/* If caller passed "don't care" fill in default values */
 	if ((config->fragment_size == 0) || (config->fragments == 0)) {
@@ -201,6 +373,7 @@ static void *compress_hw_open_by_name(const char *name,
 		oops(&bad_compress, errno, "cannot set device");
 		goto codec_fail;
 	}
+	memcpy(&compress->params, &params.codec, sizeof(compress->params));
 
 	return compress;
 
@@ -229,40 +402,18 @@ static void compress_hw_close(void *data)
 	free(compress);
 }
 
-static void compress_hw_avail64_from_32(struct snd_compr_avail64 *avail64,
-					const struct snd_compr_avail *avail32)
-{
-	avail64->avail = avail32->avail;
-
-	avail64->tstamp.byte_offset = avail32->tstamp.byte_offset;
-	avail64->tstamp.copied_total = avail32->tstamp.copied_total;
-	avail64->tstamp.pcm_frames = avail32->tstamp.pcm_frames;
-	avail64->tstamp.pcm_io_frames = avail32->tstamp.pcm_io_frames;
-	avail64->tstamp.sampling_rate = avail32->tstamp.sampling_rate;
-}
-
 static int compress_hw_get_hpointer(void *data,
 		unsigned long long *avail, struct timespec *tstamp)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
-	struct snd_compr_avail kavail32;
 	struct snd_compr_avail64 kavail64;
 	__u64 time;
 
 	if (!is_compress_hw_ready(compress))
 		return oops(compress, ENODEV, "device not ready");
 
-	const int version = get_compress_hw_version(compress);
-
-	if (version < SNDRV_PROTOCOL_VERSION(0, 4, 0)) {
-		/* SNDRV_COMPRESS_AVAIL64 not supported, fallback to SNDRV_COMPRESS_AVAIL */
-		if (ioctl(compress->fd, SNDRV_COMPRESS_AVAIL, &kavail32))
-			return oops(compress, errno, "cannot get avail");
-		compress_hw_avail64_from_32(&kavail64, &kavail32);
-	} else {
-		if (ioctl(compress->fd, SNDRV_COMPRESS_AVAIL64, &kavail64))
-			return oops(compress, errno, "cannot get avail64");
-	}
+	if (compress->proto->avail(compress, &kavail64))
+		return -1;
 
 	if (0 == kavail64.tstamp.sampling_rate)
 		return oops(compress, ENODATA, "sample rate unknown");
@@ -274,90 +425,243 @@ static int compress_hw_get_hpointer(void *data,
 	return 0;
 }
 
-static int compress_hw_get_tstamp_32(struct compress_hw_data *compress,
-			unsigned long long *samples, unsigned int *sampling_rate)
+static int compress_hw_get_snapshot(void *data,
+		struct compress_snapshot *snapshot)
 {
-	struct snd_compr_tstamp ktstamp;
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	struct snd_compr_avail64 kavail64;
+	struct timespec before, after;
 
-	if (ioctl(compress->fd, SNDRV_COMPRESS_TSTAMP, &ktstamp))
-		return oops(compress, errno, "cannot get tstamp");
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
 
-	*samples = ktstamp.pcm_io_frames;
-	*sampling_rate = ktstamp.sampling_rate;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	if (compress->proto->avail(compress, &kavail64))
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &after);
+
+	snapshot->avail = kavail64.avail;
+	snapshot->byte_offset = kavail64.tstamp.byte_offset;
+	snapshot->copied_total = kavail64.tstamp.copied_total;
+	snapshot->pcm_frames = kavail64.tstamp.pcm_frames;
+	snapshot->pcm_io_frames = kavail64.tstamp.pcm_io_frames;
+	snapshot->sampling_rate = kavail64.tstamp.sampling_rate;
+
+	/* the DSP was most likely read halfway through the ioctl */
+	after.tv_sec -= before.tv_sec;
+	after.tv_nsec -= before.tv_nsec;
+	if (after.tv_nsec < 0) {
+		after.tv_sec--;
+		after.tv_nsec += 1000000000;
+	}
+	before.tv_nsec += (after.tv_sec * 1000000000LL + after.tv_nsec) / 2;
+	before.tv_sec += before.tv_nsec / 1000000000;
+	before.tv_nsec %= 1000000000;
+	snapshot->mono = before;
 	return 0;
 }
 
-static int compress_hw_get_tstamp_64(struct compress_hw_data *compress,
+static int compress_hw_get_tstamp(void *data,
 			unsigned long long *samples, unsigned int *sampling_rate)
 {
-	struct snd_compr_tstamp64 ktstamp;
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
 
-	if (ioctl(compress->fd, SNDRV_COMPRESS_TSTAMP64, &ktstamp))
-		return oops(compress, errno, "cannot get tstamp64");
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
 
-	*samples = ktstamp.pcm_io_frames;
-	*sampling_rate = ktstamp.sampling_rate;
-	return 0;
+	return compress->proto->tstamp(compress, samples, sampling_rate);
 }
 
-static int compress_hw_get_tstamp(void *data,
-			unsigned long long *samples, unsigned int *sampling_rate)
+/*
+ * Bytes consumed per second of audio, from the compressed bytes per
+ * decoded frame seen so far or, before the DSP reported progress, from
+ * the codec bit rate. Returns 0 if nothing is known.
+ */
+static unsigned long long compress_hw_byte_rate(struct compress_hw_data *compress,
+		const struct snd_compr_avail64 *avail)
 {
-	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	const struct snd_compr_tstamp64 *tstamp = &avail->tstamp;
+	unsigned long long bytes_per_sec = 0;
+
+	if (tstamp->pcm_io_frames && tstamp->sampling_rate)
+		bytes_per_sec = (unsigned long long)tstamp->copied_total *
+				tstamp->sampling_rate / tstamp->pcm_io_frames;
+	if (!bytes_per_sec)
+		bytes_per_sec = compress->params.bit_rate / 8;
+	return bytes_per_sec;
+}
 
-	if (!is_compress_hw_ready(compress))
-		return oops(compress, ENODEV, "device not ready");
+/*
+ * Estimate how long it takes until @needed more bytes can be moved.
+ * Returns a poll timeout in milliseconds, or -1 if nothing is known.
+ */
+static int compress_hw_adaptive_timeout(struct compress_hw_data *compress,
+		const struct snd_compr_avail64 *avail, size_t needed)
+{
+	unsigned long long bytes_per_sec;
+	unsigned long long ms;
+
+	bytes_per_sec = compress_hw_byte_rate(compress, avail);
+	if (!bytes_per_sec)
+		return -1;
+
+	/* round up, waking early only costs another AVAIL ioctl */
+	ms = (needed * 1000ULL + bytes_per_sec - 1) / bytes_per_sec;
+	if (ms < 1)
+		ms = 1;
+	/* a negative maximum means no limit */
+	if (compress->max_poll_wait_ms >= 0) {
+		if (ms > (unsigned long long)compress->max_poll_wait_ms)
+			ms = compress->max_poll_wait_ms;
+	} else if (ms > INT_MAX) {
+		ms = INT_MAX;
+	}
+	return ms;
+}
 
-	if (get_compress_hw_version(compress) >= SNDRV_PROTOCOL_VERSION(0, 4, 0))
-		return compress_hw_get_tstamp_64(compress, samples, sampling_rate);
+/*
+ * Check a playback write against the low watermark: less audio than
+ * the threshold, or than one fragment if no threshold is set or the
+ * byte rate is still unknown, left queued for the DSP. The notifier
+ * fires once per dip below the watermark.
+ */
+static void compress_hw_check_watermark(struct compress_hw_data *compress,
+		const struct snd_compr_avail64 *avail)
+{
+	const unsigned int frag_size = compress->config->fragment_size;
+	const unsigned long long buffer_size =
+		(unsigned long long)frag_size * compress->config->fragments;
+	unsigned long long queued, rate, queued_us = 0;
+	int low;
+
+	queued = avail->avail < buffer_size ? buffer_size - avail->avail : 0;
+	rate = compress_hw_byte_rate(compress, avail);
+	if (rate)
+		queued_us = queued * 1000000ULL / rate;
+
+	if (compress->lwm_us && rate)
+		low = queued_us < compress->lwm_us;
 	else
-		return compress_hw_get_tstamp_32(compress, samples, sampling_rate);
+		low = queued < frag_size;
+
+	if (!low) {
+		compress->lwm_armed = 1;
+		return;
+	}
+
+	__atomic_store_n(&compress->underrun_risk, compress->underrun_risk + 1,
+			 __ATOMIC_RELAXED);
+	if (compress->lwm_notify && compress->lwm_armed) {
+		compress->lwm_armed = 0;
+		compress->lwm_notify(compress->lwm_arg, queued_us);
+	}
 }
 
-static int compress_hw_write(void *data, const void *buf, size_t size)
+/*
+ * Wait until at least one fragment, or enough space/data for the
+ * remaining @size bytes, is available in the ring buffer.
+ * Returns 1 with @avail updated when the transfer can proceed, 0 when
+ * the transfer should stop (non-blocking, paused or timed out) and
+ * negative on error.
+ */
+static int compress_hw_wait_avail(struct compress_hw_data *compress,
+		size_t size, short events, struct snd_compr_avail64 *avail)
 {
-	struct compress_hw_data *compress = (struct compress_hw_data *)data;
-	struct snd_compr_avail avail;
+	const unsigned int frag_size = compress->config->fragment_size;
 	struct pollfd fds;
+	int ret, timeout, waited = 0, first = 1, estimated;
+
+	fds.fd = compress->fd;
+	fds.events = events;
+
+	for (;;) {
+		ret = compress->proto->avail(compress, avail);
+		COMPRESS_PROBE3(hw_avail, compress->fd, ret, avail->avail);
+		compress_trace_record(compress->trace, TINYTRACE_AVAIL,
+				      avail->avail, ret);
+		if (ret)
+			return -1;
+
+		if (first && events == POLLOUT && compress->running)
+			compress_hw_check_watermark(compress, avail);
+		first = 0;
+
+		/* We can transfer if we have at least one fragment available
+		 * or there is enough space/data for all remaining bytes
+		 */
+		if ((avail->avail >= frag_size) || (avail->avail >= size))
+			return 1;
+
+		if (compress->nonblocking)
+			return 0;
+
+		timeout = compress->max_poll_wait_ms;
+		estimated = 0;
+		if (compress->adaptive_poll) {
+			ret = compress_hw_adaptive_timeout(compress, avail,
+				(size < frag_size ? size : frag_size) - avail->avail);
+			/* the estimates together stay within the maximum */
+			if (ret >= 0 && compress->max_poll_wait_ms >= 0 &&
+			    ret > compress->max_poll_wait_ms - waited)
+				ret = compress->max_poll_wait_ms - waited;
+			if (ret >= 0) {
+				timeout = ret;
+				estimated = 1;
+			}
+		}
+
+		COMPRESS_PROBE2(hw_poll_entry, compress->fd, timeout);
+		ret = poll(&fds, 1, timeout);
+		COMPRESS_PROBE3(hw_poll_return, compress->fd, ret, fds.revents);
+		compress_trace_record(compress->trace, TINYTRACE_POLL,
+				      (unsigned long long)(unsigned int)timeout << 32 |
+				      (unsigned short)fds.revents, ret);
+		if (fds.revents & POLLERR)
+			return oops(compress, EIO, "poll returned error!");
+		/* An estimated wait ran out, check again until the
+		 * maximum poll wait is spent */
+		if (ret == 0 && estimated) {
+			waited += timeout;
+			if (compress->max_poll_wait_ms < 0 ||
+			    waited < compress->max_poll_wait_ms)
+				continue;
+		}
+		if (ret == 0)
+			__atomic_store_n(&compress->poll_timeouts,
+					 compress->poll_timeouts + 1,
+					 __ATOMIC_RELAXED);
+		/* A pause will cause -EBADFD or zero.
+		 * This is not an error, just stop the transfer */
+		if ((ret == 0) || (ret < 0 && errno == EBADFD))
+			return 0;
+		if (ret < 0)
+			return oops(compress, errno, "poll error");
+		if (!(fds.revents & events))
+			return 1;
+	}
+}
+
+static int compress_hw_do_write(void *data, const void *buf, size_t size)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	struct snd_compr_avail64 avail;
 	int to_write = 0;	/* zero indicates we haven't written yet */
 	int written, total = 0, ret;
 	const char* cbuf = buf;
-	const unsigned int frag_size = compress->config->fragment_size;
 
 	if (!(compress->flags & COMPRESS_IN))
 		return oops(compress, EINVAL, "Invalid flag set");
 	if (!is_compress_hw_ready(compress))
 		return oops(compress, ENODEV, "device not ready");
-	fds.fd = compress->fd;
-	fds.events = POLLOUT;
 
 	/*TODO: treat auto start here first */
 	while (size) {
-		if (ioctl(compress->fd, SNDRV_COMPRESS_AVAIL, &avail))
-			return oops(compress, errno, "cannot get avail");
-
-		/* We can write if we have at least one fragment available
-		 * or there is enough space for all remaining data
-		 */
-		if ((avail.avail < frag_size) && (avail.avail < size)) {
-
-			if (compress->nonblocking)
-				return total;
+		ret = compress_hw_wait_avail(compress, size, POLLOUT, &avail);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
 
-			ret = poll(&fds, 1, compress->max_poll_wait_ms);
-			if (fds.revents & POLLERR) {
-				return oops(compress, EIO, "poll returned error!");
-			}
-			/* A pause will cause -EBADFD or zero.
-			 * This is not an error, just stop writing */
-			if ((ret == 0) || (ret < 0 && errno == EBADFD))
-				break;
-			if (ret < 0)
-				return oops(compress, errno, "poll error");
-			if (fds.revents & POLLOUT) {
-				continue;
-			}
-		}
 		/* write avail bytes */
 		if (size > avail.avail)
 			to_write =  avail.avail;
@@ -378,48 +682,114 @@ static int compress_hw_write(void *data, const void *buf, size_t size)
 	return total;
 }
 
-static int compress_hw_read(void *data, void *buf, size_t size)
+static int compress_hw_write(void *data, const void *buf, size_t size)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
-	struct snd_compr_avail avail;
-	struct pollfd fds;
+	int ret;
+
+	COMPRESS_PROBE2(hw_write_entry, compress->fd, size);
+	ret = compress_hw_do_write(compress, buf, size);
+	COMPRESS_PROBE2(hw_write_return, compress->fd, ret);
+	return ret;
+}
+
+/* fill @chunk with up to @len bytes of @iov starting at byte @pos */
+static int compress_hw_iov_slice(const struct iovec *iov, int iovcnt,
+		size_t pos, size_t len, struct iovec *chunk)
+{
+	int i, n = 0;
+
+	for (i = 0; i < iovcnt && len && n < COMPR_IOV_MAX; i++) {
+		if (pos >= iov[i].iov_len) {
+			pos -= iov[i].iov_len;
+			continue;
+		}
+		chunk[n].iov_base = (char *)iov[i].iov_base + pos;
+		chunk[n].iov_len = iov[i].iov_len - pos;
+		if (chunk[n].iov_len > len)
+			chunk[n].iov_len = len;
+		len -= chunk[n].iov_len;
+		pos = 0;
+		n++;
+	}
+	return n;
+}
+
+static int compress_hw_do_writev(void *data, const struct iovec *iov,
+		int iovcnt)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	struct snd_compr_avail64 avail;
+	struct iovec chunk[COMPR_IOV_MAX];
+	size_t size = 0, to_write;
+	int written, total = 0, ret, i, n;
+
+	if (!(compress->flags & COMPRESS_IN))
+		return oops(compress, EINVAL, "Invalid flag set");
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	while (size) {
+		ret = compress_hw_wait_avail(compress, size, POLLOUT, &avail);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+
+		/* gather as many segments as fit in the available space */
+		if (size > avail.avail)
+			to_write = avail.avail;
+		else
+			to_write = size;
+		n = compress_hw_iov_slice(iov, iovcnt, total, to_write, chunk);
+		written = writev(compress->fd, chunk, n);
+		if (written < 0) {
+			/* If play was paused the write returns -EBADFD */
+			if (errno == EBADFD)
+				break;
+			return oops(compress, errno, "write failed!");
+		}
+
+		size -= written;
+		total += written;
+	}
+	return total;
+}
+
+static int compress_hw_writev(void *data, const struct iovec *iov, int iovcnt)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	int ret;
+
+	COMPRESS_PROBE2(hw_writev_entry, compress->fd, iovcnt);
+	ret = compress_hw_do_writev(compress, iov, iovcnt);
+	COMPRESS_PROBE2(hw_writev_return, compress->fd, ret);
+	return ret;
+}
+
+static int compress_hw_do_read(void *data, void *buf, size_t size)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	struct snd_compr_avail64 avail;
 	int to_read = 0;
 	int num_read, total = 0, ret;
 	char* cbuf = buf;
-	const unsigned int frag_size = compress->config->fragment_size;
 
 	if (!(compress->flags & COMPRESS_OUT))
 		return oops(compress, EINVAL, "Invalid flag set");
 	if (!is_compress_hw_ready(compress))
 		return oops(compress, ENODEV, "device not ready");
-	fds.fd = compress->fd;
-	fds.events = POLLIN;
 
 	while (size) {
-		if (ioctl(compress->fd, SNDRV_COMPRESS_AVAIL, &avail))
-			return oops(compress, errno, "cannot get avail");
-
-		if ( (avail.avail < frag_size) && (avail.avail < size) ) {
-			/* Less than one fragment available and not at the
-			 * end of the read, so poll
-			 */
-			if (compress->nonblocking)
-				return total;
-
-			ret = poll(&fds, 1, compress->max_poll_wait_ms);
-			if (fds.revents & POLLERR) {
-				return oops(compress, EIO, "poll returned error!");
-			}
-			/* A pause will cause -EBADFD or zero.
-			 * This is not an error, just stop reading */
-			if ((ret == 0) || (ret < 0 && errno == EBADFD))
-				break;
-			if (ret < 0)
-				return oops(compress, errno, "poll error");
-			if (fds.revents & POLLIN) {
-				continue;
-			}
-		}
+		ret = compress_hw_wait_avail(compress, size, POLLIN, &avail);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+
 		/* read avail bytes */
 		if (size > avail.avail)
 			to_read = avail.avail;
@@ -441,13 +811,28 @@ static int compress_hw_read(void *data, void *buf, size_t size)
 	return total;
 }
 
+static int compress_hw_read(void *data, void *buf, size_t size)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	int ret;
+
+	COMPRESS_PROBE2(hw_read_entry, compress->fd, size);
+	ret = compress_hw_do_read(compress, buf, size);
+	COMPRESS_PROBE2(hw_read_return, compress->fd, ret);
+	return ret;
+}
+
 static int compress_hw_start(void *data)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	int ret;
 
 	if (!is_compress_hw_ready(compress))
 		return oops(compress, ENODEV, "device not ready");
-	if (ioctl(compress->fd, SNDRV_COMPRESS_START))
+	COMPRESS_PROBE1(hw_start_entry, compress->fd);
+	ret = ioctl(compress->fd, SNDRV_COMPRESS_START);
+	COMPRESS_PROBE2(hw_start_return, compress->fd, ret);
+	if (ret)
 		return oops(compress, errno, "cannot start the stream");
 	compress->running = 1;
 	return 0;
@@ -457,10 +842,14 @@ static int compress_hw_start(void *data)
 static int compress_hw_stop(void *data)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	int ret;
 
 	if (!is_compress_hw_running(compress))
 		return oops(compress, ENODEV, "device not ready");
-	if (ioctl(compress->fd, SNDRV_COMPRESS_STOP))
+	COMPRESS_PROBE1(hw_stop_entry, compress->fd);
+	ret = ioctl(compress->fd, SNDRV_COMPRESS_STOP);
+	COMPRESS_PROBE2(hw_stop_return, compress->fd, ret);
+	if (ret)
 		return oops(compress, errno, "cannot stop the stream");
 	return 0;
 }
@@ -488,10 +877,14 @@ static int compress_hw_resume(void *data)
 static int compress_hw_drain(void *data)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	int ret;
 
 	if (!is_compress_hw_running(compress))
 		return oops(compress, ENODEV, "device not ready");
-	if (ioctl(compress->fd, SNDRV_COMPRESS_DRAIN))
+	COMPRESS_PROBE1(hw_drain_entry, compress->fd);
+	ret = ioctl(compress->fd, SNDRV_COMPRESS_DRAIN);
+	COMPRESS_PROBE2(hw_drain_return, compress->fd, ret);
+	if (ret)
 		return oops(compress, errno, "cannot drain the stream");
 	return 0;
 }
@@ -499,13 +892,17 @@ static int compress_hw_drain(void *data)
 static int compress_hw_partial_drain(void *data)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	int ret;
 
 	if (!is_compress_hw_running(compress))
 		return oops(compress, ENODEV, "device not ready");
 
 	if (!compress->next_track)
 		return oops(compress, EPERM, "next track not signalled");
-	if (ioctl(compress->fd, SNDRV_COMPRESS_PARTIAL_DRAIN))
+	COMPRESS_PROBE1(hw_partial_drain_entry, compress->fd);
+	ret = ioctl(compress->fd, SNDRV_COMPRESS_PARTIAL_DRAIN);
+	COMPRESS_PROBE2(hw_partial_drain_return, compress->fd, ret);
+	if (ret)
 		return oops(compress, errno, "cannot drain the stream\n");
 	compress->next_track = 0;
 	return 0;
@@ -524,6 +921,7 @@ static int compress_hw_next_track(void *data)
 		return oops(compress, errno, "cannot set next track\n");
 	compress->next_track = 1;
 	compress->gapless_metadata = 0;
+	compress->mdata_valid = 0;
 	return 0;
 }
 
@@ -531,25 +929,13 @@ static int compress_hw_set_gapless_metadata(void *data,
 	struct compr_gapless_mdata *mdata)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
-	struct snd_compr_metadata metadata;
 
 	if (!is_compress_hw_ready(compress))
 		return oops(compress, ENODEV, "device not ready");
 
-	const int version = get_compress_hw_version(compress);
-
-	if (version < SNDRV_PROTOCOL_VERSION(0, 1, 1))
-		return oops(compress, ENXIO, "gapless apis not supported in kernel");
-
-	metadata.key = SNDRV_COMPRESS_ENCODER_PADDING;
-	metadata.value[0] = mdata->encoder_padding;
-	if (ioctl(compress->fd, SNDRV_COMPRESS_SET_METADATA, &metadata))
-		return oops(compress, errno, "can't set metadata for stream\n");
-
-	metadata.key = SNDRV_COMPRESS_ENCODER_DELAY;
-	metadata.value[0] = mdata->encoder_delay;
-	if (ioctl(compress->fd, SNDRV_COMPRESS_SET_METADATA, &metadata))
-		return oops(compress, errno, "can't set metadata for stream\n");
+	compress->mdata_valid = 0;
+	if (compress->proto->set_metadata(compress, mdata))
+		return -1;
 	compress->gapless_metadata = 1;
 	return 0;
 }
@@ -557,15 +943,27 @@ static int compress_hw_set_gapless_metadata(void *data,
 static bool compress_hw_is_codec_supported_by_name(const char *name,
 		unsigned int flags, struct snd_codec *codec)
 {
+	struct snd_compr_caps caps;
 	unsigned int card, device;
-	unsigned int dev_flag;
-	bool ret;
-	int fd;
+	unsigned int dev_flag, direction;
+	int fd, version;
 	char fn[256];
 
 	if (sscanf(&name[3], "%u,%u", &card, &device) != 2)
 		return false;
 
+	if (!compress_caps_cache_get(card, device, NULL, &caps)) {
+		/* like the open below, refuse the node's other direction */
+		direction = (flags & COMPRESS_OUT) ? SND_COMPRESS_CAPTURE :
+						     SND_COMPRESS_PLAYBACK;
+		if (caps.direction != direction) {
+			oops(&bad_compress, EINVAL,
+			     "device '%s' has the other direction", name);
+			return false;
+		}
+		return _is_codec_type_supported(&caps, codec);
+	}
+
 	snprintf(fn, sizeof(fn), "/dev/snd/comprC%uD%u", card, device);
 
 	if (flags & COMPRESS_OUT)
@@ -574,13 +972,21 @@ static bool compress_hw_is_codec_supported_by_name(const char *name,
 		dev_flag = O_WRONLY;
 
 	fd = open(fn, dev_flag);
-	if (fd < 0)
-		return oops(&bad_compress, errno, "cannot open device '%s'", fn);
-
-	ret = _is_codec_type_supported(fd, codec);
+	if (fd < 0) {
+		oops(&bad_compress, errno, "cannot open device '%s'", fn);
+		return false;
+	}
 
+	if (ioctl(fd, SNDRV_COMPRESS_IOCTL_VERSION, &version) ||
+	    ioctl(fd, SNDRV_COMPRESS_GET_CAPS, &caps)) {
+		oops(&bad_compress, errno, "cannot get device caps");
+		close(fd);
+		return false;
+	}
 	close(fd);
-	return ret;
+
+	compress_caps_cache_put(card, device, version, &caps);
+	return _is_codec_type_supported(&caps, codec);
 }
 
 static void compress_hw_set_max_poll_wait(void *data, int milliseconds)
@@ -590,6 +996,30 @@ static void compress_hw_set_max_poll_wait(void *data, int milliseconds)
 	compress->max_poll_wait_ms = milliseconds;
 }
 
+static int compress_hw_set_adaptive_poll(void *data, int enable)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	compress->adaptive_poll = !!enable;
+	return 0;
+}
+
+static int compress_hw_set_low_watermark(void *data, unsigned int threshold_us,
+		void (*notify)(void *arg, unsigned long long queued_us),
+		void *arg)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	if (!(compress->flags & COMPRESS_IN))
+		return oops(compress, EINVAL, "Invalid flag set");
+
+	compress->lwm_us = threshold_us;
+	compress->lwm_notify = notify;
+	compress->lwm_arg = arg;
+	compress->lwm_armed = 1;
+	return 0;
+}
+
 static void compress_hw_set_nonblock(void *data, int nonblock)
 {
 	struct compress_hw_data *compress = (struct compress_hw_data *)data;
@@ -640,14 +1070,202 @@ static int compress_hw_set_codec_params(void *data, struct snd_codec *codec)
 	params.buffer.fragments = compress->config->fragments;
 	memcpy(&params.codec, codec, sizeof(params.codec));
 
+	compress->codec_valid = 0;
 	if (ioctl(compress->fd, SNDRV_COMPRESS_SET_PARAMS, &params))
 		return oops(compress, errno, "cannot set param for next track\n");
+	memcpy(&compress->params, codec, sizeof(compress->params));
+
+	return 0;
+}
 
+/* check a new configuration against the caps read at open time */
+static int compress_hw_check_config(struct compress_hw_data *compress,
+		struct compr_config *config)
+{
+	const struct snd_compr_caps *caps = &compress->caps;
+	unsigned int i;
+
+	if (config->fragment_size < caps->min_fragment_size ||
+	    config->fragment_size > caps->max_fragment_size ||
+	    config->fragments < caps->min_fragments ||
+	    config->fragments > caps->max_fragments)
+		return oops(compress, EINVAL, "fragments %u x %u out of range",
+			    config->fragments, config->fragment_size);
+
+	for (i = 0; i < caps->num_codecs; i++)
+		if (caps->codecs[i] == config->codec->id)
+			return 0;
+	return oops(compress, EINVAL, "codec %u not supported",
+		    config->codec->id);
+}
+
+static int compress_hw_reconfigure(void *data, struct compr_config *config)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+	struct snd_compr_params params;
+	char fn[256];
+	int fd;
+
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
+
+	if (!config || !config->codec)
+		return oops(compress, EINVAL, "passed bad config");
+
+	/* zero keeps the current buffer layout */
+	if (!config->fragment_size || !config->fragments) {
+		config->fragment_size = compress->config->fragment_size;
+		config->fragments = compress->config->fragments;
+	}
+
+	if (compress_hw_check_config(compress, config))
+		return -1;
+
+	/* a drained stream is back in SETUP and can simply be restarted */
+	if (config->fragment_size == compress->config->fragment_size &&
+	    config->fragments == compress->config->fragments &&
+	    !memcmp(config->codec, &compress->params, sizeof(compress->params)))
+		goto done;
+
+	fill_compress_hw_params(config, &params);
+	if (ioctl(compress->fd, SNDRV_COMPRESS_SET_PARAMS, &params)) {
+		if (errno != EPERM && errno != EBADFD)
+			return oops(compress, errno, "cannot set device");
+
+		/*
+		 * The kernel only takes new params before the first
+		 * SET_PARAMS, so reopen the node. Version and caps are
+		 * known already and need not be queried again. Most drivers
+		 * allow one open per node, so the old fd goes first.
+		 */
+		snprintf(fn, sizeof(fn), "/dev/snd/comprC%uD%u",
+			 compress->card, compress->device);
+		close(compress->fd);
+		compress->running = 0;
+		if (compress->flags & COMPRESS_OUT)
+			fd = open(fn, O_RDONLY);
+		else
+			fd = open(fn, O_WRONLY);
+		compress->fd = fd;
+		if (fd < 0)
+			return oops(compress, errno, "cannot open device '%s'", fn);
+
+		if (ioctl(compress->fd, SNDRV_COMPRESS_SET_PARAMS, &params)) {
+			oops(compress, errno, "cannot set device");
+			close(compress->fd);
+			compress->fd = -1;
+			return -1;
+		}
+	}
+
+	compress->config->fragment_size = config->fragment_size;
+	compress->config->fragments = config->fragments;
+	memcpy(&compress->params, config->codec, sizeof(compress->params));
+done:
+	compress->running = 0;
+	compress->next_track = 0;
+	compress->gapless_metadata = 0;
+	compress->codec_valid = 0;
+	compress->mdata_valid = 0;
+	return 0;
+}
+
+static int compress_hw_get_metadata(void *data, struct compr_gapless_mdata *mdata)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
+
+	if (!compress->mdata_valid) {
+		if (compress->proto->get_metadata(compress, &compress->mdata))
+			return -1;
+		compress->mdata_valid = 1;
+	}
+
+	*mdata = compress->mdata;
+	return 0;
+}
+
+static int compress_hw_get_codec_params(void *data, struct snd_codec *codec)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
+
+	if (!compress->codec_valid) {
+		if (ioctl(compress->fd, SNDRV_COMPRESS_GET_PARAMS, &compress->codec))
+			return oops(compress, errno, "cannot get codec params");
+		compress->codec_valid = 1;
+	}
+
+	memcpy(codec, &compress->codec, sizeof(*codec));
+	return 0;
+}
+
+static int compress_hw_queue_next_track(void *data, struct snd_codec *codec,
+		struct compr_gapless_mdata *mdata)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	/* validate up front so that nothing is half armed on failure */
+	if (!is_compress_hw_running(compress))
+		return oops(compress, ENODEV, "device not ready");
+	if (!compress->proto->gapless)
+		return oops(compress, ENXIO, "gapless apis not supported in kernel");
+
+	if (compress_hw_set_gapless_metadata(compress, mdata))
+		return -1;
+	if (compress_hw_next_track(compress))
+		return -1;
+	if (codec && compress_hw_set_codec_params(compress, codec))
+		return -1;
+	return 0;
+}
+
+static int compress_hw_get_poll_fd(void *data)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
+
+	return compress->fd;
+}
+
+static int compress_hw_get_caps(void *data, struct snd_compr_caps *caps)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	if (!is_compress_hw_ready(compress))
+		return oops(compress, ENODEV, "device not ready");
+
+	memcpy(caps, &compress->caps, sizeof(*caps));
 	return 0;
 }
 
+static int compress_hw_get_stats(void *data, struct compress_stats *stats)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	/* counted by the stream's thread, read from any */
+	stats->poll_timeouts = __atomic_load_n(&compress->poll_timeouts,
+					       __ATOMIC_RELAXED);
+	stats->underrun_risk = __atomic_load_n(&compress->underrun_risk,
+					       __ATOMIC_RELAXED);
+	return 0;
+}
+
+void compress_hw_set_trace(void *data, struct compress_trace *trace)
+{
+	struct compress_hw_data *compress = (struct compress_hw_data *)data;
+
+	compress->trace = trace;
+}
+
 struct compress_ops compress_hw_ops = {
-	.magic = COMPRESS_OPS_V2,
+	.magic = COMPRESS_OPS_V3,
 	.open_by_name = compress_hw_open_by_name,
 	.close = compress_hw_close,
 	.get_hpointer = compress_hw_get_hpointer,
@@ -670,5 +1288,22 @@ struct compress_ops compress_hw_ops = {
 	.is_compress_ready = is_compress_hw_ready,
 	.get_error = compress_hw_get_error,
 	.set_codec_params = compress_hw_set_codec_params,
+	.size = sizeof(struct compress_ops),
+	.features = COMPRESS_OPS_F_WRITEV | COMPRESS_OPS_F_POLL_FD |
+		    COMPRESS_OPS_F_CAPS | COMPRESS_OPS_F_QUEUE_NEXT_TRACK |
+		    COMPRESS_OPS_F_READBACK | COMPRESS_OPS_F_ADAPTIVE_POLL |
+		    COMPRESS_OPS_F_SNAPSHOT | COMPRESS_OPS_F_RECONFIGURE |
+		    COMPRESS_OPS_F_STATS | COMPRESS_OPS_F_LOW_WATERMARK,
+	.writev = compress_hw_writev,
+	.get_poll_fd = compress_hw_get_poll_fd,
+	.get_caps = compress_hw_get_caps,
+	.queue_next_track = compress_hw_queue_next_track,
+	.get_metadata = compress_hw_get_metadata,
+	.get_codec_params = compress_hw_get_codec_params,
+	.set_adaptive_poll = compress_hw_set_adaptive_poll,
+	.get_snapshot = compress_hw_get_snapshot,
+	.reconfigure = compress_hw_reconfigure,
+	.get_stats = compress_hw_get_stats,
+	.set_low_watermark = compress_hw_set_low_watermark,
 };
 
@@ -0,0 +1,367 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Background exporter of the stream counters in Prometheus text format.
+ *
+ * A snapshot of every open stream is taken each interval and either
+ * written to a file, replaced atomically so collectors never read half
+ * of it, or sent over a fresh connection to a UNIX stream socket.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "compress_metrics.h"
+
+#define DEFAULT_METRICS_INTERVAL_MS	10000
+
+struct compress_metric {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset;		/* of the counter in struct compress_stats */
+	int ns;			/* counter in ns, exported in seconds */
+};
+
+#define STAT(field)	offsetof(struct compress_stats, field)
+
+static const struct compress_metric compress_metrics_table[] = {
+	{ "tinycompress_bytes_total", "counter",
+	  "Bytes written to or read from the stream.", STAT(bytes), 0 },
+	{ "tinycompress_transfers_total", "counter",
+	  "Write and read calls.", STAT(transfers), 0 },
+	{ "tinycompress_partial_transfers_total", "counter",
+	  "Write and read calls which moved fewer bytes than asked.",
+	  STAT(partial_transfers), 0 },
+	{ "tinycompress_errors_total", "counter",
+	  "Calls of the stream which failed.", STAT(errors), 0 },
+	{ "tinycompress_poll_timeouts_total", "counter",
+	  "Waits for buffer space or data which timed out.",
+	  STAT(poll_timeouts), 0 },
+	{ "tinycompress_underrun_risk_total", "counter",
+	  "Playback writes which found less than a fragment queued.",
+	  STAT(underrun_risk), 0 },
+	{ "tinycompress_drains_total", "counter",
+	  "Completed drains and partial drains.", STAT(drains), 0 },
+	{ "tinycompress_drain_seconds_total", "counter",
+	  "Time spent in drains and partial drains.", STAT(drain_ns), 1 },
+	{ "tinycompress_drain_seconds_max", "gauge",
+	  "Longest drain or partial drain.", STAT(drain_max_ns), 1 },
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	char *target;
+	unsigned int interval_ms;
+} compress_metrics = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct compress_metrics_streams {
+	struct compress_stream_info *info;
+	char (*names)[COMPRESS_STREAM_NAME_MAX];
+	unsigned int count;
+	unsigned int size;
+};
+
+static void compress_metrics_collect(const struct compress_stream_info *info,
+		void *arg)
+{
+	struct compress_metrics_streams *streams = arg;
+	unsigned int size;
+	void *tmp;
+
+	if (streams->count == streams->size) {
+		size = streams->size ? streams->size * 2 : 8;
+		tmp = realloc(streams->info, size * sizeof(*streams->info));
+		if (!tmp)
+			return;
+		streams->info = tmp;
+		tmp = realloc(streams->names, size * sizeof(*streams->names));
+		if (!tmp)
+			return;
+		streams->names = tmp;
+		streams->size = size;
+	}
+
+	/* the name goes away with the stream, keep a copy */
+	snprintf(streams->names[streams->count], COMPRESS_STREAM_NAME_MAX,
+		 "%s", info->name);
+	streams->info[streams->count] = *info;
+	streams->info[streams->count].name = streams->names[streams->count];
+	streams->count++;
+}
+
+static void compress_metrics_labels(FILE *out,
+		const struct compress_stream_info *info)
+{
+	const char *p;
+
+	fprintf(out, "{pid=\"%d\",id=\"%u\",stream=\"", (int)getpid(),
+		info->id);
+	for (p = info->name; *p; p++) {
+		if (*p == '\\' || *p == '"')
+			fputc('\\', out);
+		if (*p == '\n')
+			fputs("\\n", out);
+		else
+			fputc(*p, out);
+	}
+	fprintf(out, "\",direction=\"%s\"}",
+		(info->flags & COMPRESS_OUT) ? "capture" : "playback");
+}
+
+/* returns a malloc()ed snapshot, NULL on error */
+static char *compress_metrics_format(size_t *len)
+{
+	struct compress_metrics_streams streams = { 0 };
+	const struct compress_metric *metric;
+	unsigned long long value;
+	unsigned int i, j;
+	char *buf = NULL;
+	FILE *out;
+
+	compress_foreach_stream(compress_metrics_collect, &streams);
+
+	out = open_memstream(&buf, len);
+	if (!out)
+		goto done;
+
+	fprintf(out, "# HELP tinycompress_streams Open compress streams.\n"
+		"# TYPE tinycompress_streams gauge\n"
+		"tinycompress_streams{pid=\"%d\"} %u\n",
+		(int)getpid(), streams.count);
+
+	for (i = 0; i < sizeof(compress_metrics_table) /
+			sizeof(compress_metrics_table[0]); i++) {
+		metric = &compress_metrics_table[i];
+		fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric->name,
+			metric->help, metric->name, metric->type);
+		for (j = 0; j < streams.count; j++) {
+			memcpy(&value, (const char *)&streams.info[j].stats +
+			       metric->offset, sizeof(value));
+			fputs(metric->name, out);
+			compress_metrics_labels(out, &streams.info[j]);
+			if (metric->ns)
+				fprintf(out, " %.9f\n", value / 1e9);
+			else
+				fprintf(out, " %llu\n", value);
+		}
+	}
+
+	if (fclose(out)) {
+		free(buf);
+		buf = NULL;
+	}
+done:
+	free(streams.info);
+	free(streams.names);
+	return buf;
+}
+
+static int compress_metrics_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == ENOTSOCK)
+			ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int compress_metrics_to_socket(const char *path, const char *buf,
+		size_t len)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		ret = -errno;
+	else
+		ret = compress_metrics_write_all(fd, buf, len);
+	close(fd);
+	return ret;
+}
+
+static int compress_metrics_to_file(const char *path, const char *buf,
+		size_t len)
+{
+	char *tmp;
+	int fd, ret;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return -ENOMEM;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	/* collectors usually run as another user */
+	fchmod(fd, 0644);
+	ret = compress_metrics_write_all(fd, buf, len);
+	close(fd);
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+out:
+	free(tmp);
+	return ret;
+}
+
+static void *compress_metrics_thread(void *arg)
+{
+	struct timespec deadline;
+	size_t len;
+	char *buf;
+
+	(void)arg;
+	pthread_mutex_lock(&compress_metrics.lock);
+	while (!compress_metrics.stop) {
+		pthread_mutex_unlock(&compress_metrics.lock);
+
+		/* a collector which is not there yet is retried next time */
+		buf = compress_metrics_format(&len);
+		if (buf) {
+			if (!strncmp(compress_metrics.target, "unix:", 5))
+				compress_metrics_to_socket(
+					compress_metrics.target + 5, buf, len);
+			else
+				compress_metrics_to_file(compress_metrics.target,
+							 buf, len);
+			free(buf);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += compress_metrics.interval_ms / 1000;
+		deadline.tv_nsec += (compress_metrics.interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&compress_metrics.lock);
+		while (!compress_metrics.stop &&
+		       pthread_cond_timedwait(&compress_metrics.cond,
+					      &compress_metrics.lock,
+					      &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&compress_metrics.lock);
+	return NULL;
+}
+
+int compress_metrics_start(const char *target, unsigned int interval_ms)
+{
+	pthread_condattr_t attr;
+	int ret = 0;
+
+	if (!target || !*target)
+		return -EINVAL;
+
+	pthread_mutex_lock(&compress_metrics.lock);
+	if (compress_metrics.running) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	compress_metrics.target = strdup(target);
+	if (!compress_metrics.target) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	compress_metrics.interval_ms = interval_ms ? interval_ms :
+					DEFAULT_METRICS_INTERVAL_MS;
+	compress_metrics.stop = 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&compress_metrics.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = -pthread_create(&compress_metrics.thread, NULL,
+			      compress_metrics_thread, NULL);
+	if (ret) {
+		pthread_cond_destroy(&compress_metrics.cond);
+		free(compress_metrics.target);
+		compress_metrics.target = NULL;
+		goto unlock;
+	}
+	compress_metrics.running = 1;
+unlock:
+	pthread_mutex_unlock(&compress_metrics.lock);
+	return ret;
+}
+
+void compress_metrics_stop(void)
+{
+	pthread_t thread;
+
+	pthread_mutex_lock(&compress_metrics.lock);
+	if (!compress_metrics.running || compress_metrics.stop) {
+		pthread_mutex_unlock(&compress_metrics.lock);
+		return;
+	}
+	compress_metrics.stop = 1;
+	thread = compress_metrics.thread;
+	pthread_cond_signal(&compress_metrics.cond);
+	pthread_mutex_unlock(&compress_metrics.lock);
+
+	pthread_join(thread, NULL);
+
+	pthread_mutex_lock(&compress_metrics.lock);
+	pthread_cond_destroy(&compress_metrics.cond);
+	free(compress_metrics.target);
+	compress_metrics.target = NULL;
+	compress_metrics.running = 0;
+	pthread_mutex_unlock(&compress_metrics.lock);
+}
+
+static void compress_metrics_from_env(void)
+{
+	const char *target = getenv("TINYCOMPRESS_METRICS");
+	const char *interval = getenv("TINYCOMPRESS_METRICS_INTERVAL_MS");
+
+	if (target && *target)
+		compress_metrics_start(target,
+				       interval ? strtoul(interval, NULL, 0) : 0);
+}
+
+void compress_metrics_autostart(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, compress_metrics_from_env);
+}
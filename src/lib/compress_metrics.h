@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Glue between the stream registry in compress.c and the metrics
+ * exporter in compress_metrics.c.
+ */
+
+#ifndef __COMPRESS_METRICS_H
+#define __COMPRESS_METRICS_H
+
+#include "tinycompress/tinycompress.h"
+
+#define COMPRESS_STREAM_NAME_MAX	64
+
+struct compress_stream_info {
+	const char *name;	/* as passed to compress_open_by_name() */
+	unsigned int id;	/* unique within the process */
+	unsigned int flags;
+	struct compress_stats stats;
+};
+
+/* call @fn for every open stream of the process */
+void compress_foreach_stream(void (*fn)(const struct compress_stream_info *info,
+		void *arg), void *arg);
+
+/* start the exporter once if TINYCOMPRESS_METRICS is set */
+void compress_metrics_autostart(void);
+
+#endif
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * USDT static probes on the hot paths of the library, provider
+ * "tinycompress". A probe site is a single nop until a tracer such as
+ * perf or bpftrace attaches to it, e.g.
+ *
+ *   bpftrace -e 'usdt:libtinycompress.so:tinycompress:hw_poll_return
+ *		{ @[arg1] = count(); }'
+ *
+ * Without sys/sdt.h (or with --disable-usdt) the probes compile away.
+ */
+
+#ifndef __COMPRESS_PROBES_H
+#define __COMPRESS_PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define COMPRESS_PROBE1(name, a)	STAP_PROBE1(tinycompress, name, a)
+#define COMPRESS_PROBE2(name, a, b)	STAP_PROBE2(tinycompress, name, a, b)
+#define COMPRESS_PROBE3(name, a, b, c)	\
+	STAP_PROBE3(tinycompress, name, a, b, c)
+#else
+#define COMPRESS_PROBE1(name, a)	do { (void)(a); } while (0)
+#define COMPRESS_PROBE2(name, a, b)	do { (void)(a); (void)(b); } while (0)
+#define COMPRESS_PROBE3(name, a, b, c)	\
+	do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * Per-stream flight recorder, see compress_set_trace().
+ *
+ * Events go into a fixed ring of slots which is overwritten once full.
+ * Recording takes no lock: a writer claims a slot with one atomic add
+ * and publishes it with a sequence number, so a dump running in another
+ * thread can skip a slot caught half written.
+ */
+
+#ifndef __COMPRESS_TRACE_H
+#define __COMPRESS_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "tinycompress/tinytrace.h"
+
+struct compress_trace_slot {
+	uint64_t seq;		/* index + 1 once complete, 0 while written */
+	struct tinytrace_record rec;
+};
+
+struct compress_trace {
+	struct compress_trace_slot *slots;
+	unsigned int mask;	/* slots - 1, the count is a power of two */
+	uint64_t head;		/* events recorded so far */
+	uint64_t start_ns;
+	int error_fd;		/* dump here on the first error, or -1 */
+};
+
+static inline void compress_trace_record(struct compress_trace *trace,
+		unsigned int event, unsigned long long value, int result)
+{
+	struct compress_trace_slot *slot;
+	struct timespec ts;
+	uint64_t idx;
+
+	if (!trace)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	idx = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	slot = &trace->slots[idx & trace->mask];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	slot->rec.value = value;
+	slot->rec.result = result;
+	slot->rec.event = event;
+	__atomic_store_n(&slot->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/* let the hw backend record avail and poll events into @trace */
+void compress_hw_set_trace(void *data, struct compress_trace *trace);
+
+#endif
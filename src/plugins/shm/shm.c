@@ -0,0 +1,589 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * shm plugin: client side of an out-of-process compress stream.
+ *
+ * Name format is 'shm:<socket path>'. The stream itself is owned by the
+ * cshmd host listening on <socket path>; see compress_shm.h for the
+ * protocol. Data moves through a shared memory ring, only control ops
+ * are sent over the socket.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tinycompress/tinycompress.h"
+#include "tinycompress/compress_ops.h"
+#include "tinycompress/compress_shm.h"
+
+/* Default maximum time we will wait in a poll() - 20 seconds */
+#define DEFAULT_MAX_POLL_WAIT_MS	20000
+
+struct shm_data {
+	int sock;
+	int fds[COMPRESS_SHM_NUM_FDS];
+	struct compress_shm_ring *ring;
+	size_t map_size;
+	uint32_t ring_size;
+	unsigned int flags;
+	int running;
+	int lost;		/* the host went away, the stream is dead */
+	int max_poll_wait_ms;
+	int nonblocking;
+	char error[COMPRESS_SHM_ERR_MAX];
+};
+
+static int shm_oops(struct shm_data *shm, int e, const char *fmt, ...)
+{
+	va_list ap;
+	int sz;
+
+	va_start(ap, fmt);
+	vsnprintf(shm->error, COMPRESS_SHM_ERR_MAX, fmt, ap);
+	va_end(ap);
+	sz = strlen(shm->error);
+
+	snprintf(shm->error + sz, COMPRESS_SHM_ERR_MAX - sz,
+		": %s", strerror(e));
+	errno = e;
+
+	return -1;
+}
+
+static int shm_connect(const char *name)
+{
+	struct sockaddr_un addr;
+	const char *path;
+	int sock;
+
+	path = strchr(name, ':');
+	if (!path || strlen(path + 1) >= sizeof(addr.sun_path)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path + 1);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Send @req and wait for the matching reply. Descriptors attached to the
+ * reply are stored in @fds when it is not NULL.
+ */
+static int shm_transact(int sock, struct compress_shm_req *req,
+		struct compress_shm_resp *resp, int *fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * COMPRESS_SHM_NUM_FDS)];
+	struct iovec iov = { resp, sizeof(*resp) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	if (send(sock, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req))
+		return -1;
+
+	ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(*resp)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS) {
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *passed = (int *)CMSG_DATA(cmsg);
+		int i;
+
+		for (i = 0; i < n; i++) {
+			if (fds && n == COMPRESS_SHM_NUM_FDS)
+				fds[i] = passed[i];
+			else
+				close(passed[i]);
+		}
+	}
+	return 0;
+}
+
+static int shm_ctl(struct shm_data *shm, struct compress_shm_req *req,
+		struct compress_shm_resp *resp)
+{
+	if (shm_transact(shm->sock, req, resp, NULL)) {
+		shm->lost = 1;
+		shm->running = 0;
+		return shm_oops(shm, errno, "lost connection to host");
+	}
+
+	if (resp->ret < 0) {
+		resp->error[COMPRESS_SHM_ERR_MAX - 1] = '\0';
+		strcpy(shm->error, resp->error);
+		errno = resp->err;
+		return -1;
+	}
+	return resp->ret;
+}
+
+static int shm_simple_ctl(struct shm_data *shm, enum compress_shm_cmd cmd)
+{
+	struct compress_shm_req req = { .cmd = cmd };
+	struct compress_shm_resp resp;
+
+	return shm_ctl(shm, &req, &resp);
+}
+
+static void *shm_open_by_name(const char *name,
+		unsigned int flags, struct compr_config *config)
+{
+	struct compress_shm_req req = { .cmd = COMPRESS_SHM_OPEN };
+	struct compress_shm_resp resp;
+	struct shm_data *shm;
+	int i;
+
+	if (!config || !config->codec)
+		return NULL;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		shm->fds[i] = -1;
+
+	shm->sock = shm_connect(name);
+	if (shm->sock < 0)
+		goto conn_fail;
+
+	req.open.flags = flags;
+	req.open.fragment_size = config->fragment_size;
+	req.open.fragments = config->fragments;
+	memcpy(&req.open.codec, config->codec, sizeof(req.open.codec));
+
+	if (shm_transact(shm->sock, &req, &resp, shm->fds) || resp.ret < 0)
+		goto sock_fail;
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		if (shm->fds[i] < 0)
+			goto sock_fail;
+
+	shm->ring_size = resp.open.ring_size;
+	if (!shm->ring_size || (shm->ring_size & (shm->ring_size - 1)))
+		goto fds_fail;
+
+	shm->map_size = sizeof(*shm->ring) + shm->ring_size;
+	shm->ring = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, shm->fds[COMPRESS_SHM_FD_RING], 0);
+	if (shm->ring == MAP_FAILED || shm->ring->magic != COMPRESS_SHM_MAGIC)
+		goto fds_fail;
+
+	config->fragment_size = resp.open.fragment_size;
+	config->fragments = resp.open.fragments;
+	shm->flags = flags;
+	shm->max_poll_wait_ms = DEFAULT_MAX_POLL_WAIT_MS;
+	return shm;
+
+fds_fail:
+	if (shm->ring && shm->ring != MAP_FAILED)
+		munmap(shm->ring, shm->map_size);
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		if (shm->fds[i] >= 0)
+			close(shm->fds[i]);
+sock_fail:
+	close(shm->sock);
+conn_fail:
+	free(shm);
+	return NULL;
+}
+
+static void shm_close(void *data)
+{
+	struct shm_data *shm = data;
+	int i;
+
+	shm_simple_ctl(shm, COMPRESS_SHM_CLOSE);
+
+	munmap(shm->ring, shm->map_size);
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		close(shm->fds[i]);
+	close(shm->sock);
+	free(shm);
+}
+
+static void shm_kick(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0) {
+		/* counter saturated, the peer is already signalled */
+	}
+}
+
+/*
+ * Wait for the peer to signal @efd. Returns 1 when signalled, 0 on
+ * timeout and negative on error.
+ */
+static int shm_wait_efd(struct shm_data *shm, int efd, int timeout_ms)
+{
+	/* the socket only reports a hang up of the host */
+	struct pollfd fds[2] = {
+		{ .fd = efd, .events = POLLIN },
+		{ .fd = shm->sock, .events = 0 },
+	};
+	uint64_t cnt;
+	int ret;
+
+	ret = poll(fds, 2, timeout_ms);
+	if (ret < 0)
+		return shm_oops(shm, errno, "poll error");
+	if (ret == 0)
+		return 0;
+	if (fds[1].revents & (POLLHUP | POLLERR)) {
+		shm->lost = 1;
+		shm->running = 0;
+		return shm_oops(shm, EPIPE, "lost connection to host");
+	}
+	if (!fds[0].revents)
+		return 1;
+	if (fds[0].revents & POLLERR)
+		return shm_oops(shm, EIO, "poll returned error!");
+	if (read(efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		return shm_oops(shm, errno, "cannot read eventfd");
+	return 1;
+}
+
+static int shm_write(void *data, const void *buf, size_t size)
+{
+	struct shm_data *shm = data;
+	const char *cbuf = buf;
+	int total = 0, ret;
+	uint32_t len;
+	char *ptr;
+
+	if (!(shm->flags & COMPRESS_IN))
+		return shm_oops(shm, EINVAL, "Invalid flag set");
+	if (shm->lost)
+		return shm_oops(shm, EPIPE, "lost connection to host");
+
+	while (size) {
+		len = compress_shm_ring_reserve(shm->ring, shm->ring_size, &ptr);
+		if (!len) {
+			shm_kick(shm->fds[COMPRESS_SHM_FD_DATA]);
+			if (shm->nonblocking)
+				break;
+			ret = shm_wait_efd(shm, shm->fds[COMPRESS_SHM_FD_SPACE],
+					   shm->max_poll_wait_ms);
+			if (ret < 0)
+				return ret;
+			if (ret == 0)
+				break;
+			continue;
+		}
+		if (len > size)
+			len = size;
+		memcpy(ptr, cbuf, len);
+		compress_shm_ring_commit(shm->ring, len);
+
+		size -= len;
+		cbuf += len;
+		total += len;
+	}
+
+	if (total)
+		shm_kick(shm->fds[COMPRESS_SHM_FD_DATA]);
+	return total;
+}
+
+static int shm_read(void *data, void *buf, size_t size)
+{
+	struct shm_data *shm = data;
+	char *cbuf = buf;
+	int total = 0, ret;
+	uint32_t len;
+	char *ptr;
+
+	if (!(shm->flags & COMPRESS_OUT))
+		return shm_oops(shm, EINVAL, "Invalid flag set");
+	if (shm->lost)
+		return shm_oops(shm, EPIPE, "lost connection to host");
+
+	while (size) {
+		len = compress_shm_ring_peek(shm->ring, shm->ring_size, &ptr);
+		if (!len) {
+			shm_kick(shm->fds[COMPRESS_SHM_FD_SPACE]);
+			if (shm->nonblocking)
+				break;
+			ret = shm_wait_efd(shm, shm->fds[COMPRESS_SHM_FD_DATA],
+					   shm->max_poll_wait_ms);
+			if (ret < 0)
+				return ret;
+			if (ret == 0)
+				break;
+			continue;
+		}
+		if (len > size)
+			len = size;
+		memcpy(cbuf, ptr, len);
+		compress_shm_ring_consume(shm->ring, len);
+
+		size -= len;
+		cbuf += len;
+		total += len;
+	}
+
+	if (total)
+		shm_kick(shm->fds[COMPRESS_SHM_FD_SPACE]);
+	return total;
+}
+
+static int shm_get_hpointer(void *data,
+		unsigned long long *avail, struct timespec *tstamp)
+{
+	struct shm_data *shm = data;
+	struct compress_shm_req req = { .cmd = COMPRESS_SHM_GET_HPOINTER };
+	struct compress_shm_resp resp;
+	int ret;
+
+	ret = shm_ctl(shm, &req, &resp);
+	if (ret < 0)
+		return ret;
+
+	*avail = resp.hpointer.avail;
+	tstamp->tv_sec = resp.hpointer.tv_sec;
+	tstamp->tv_nsec = resp.hpointer.tv_nsec;
+	return 0;
+}
+
+static int shm_get_tstamp(void *data,
+		unsigned long long *samples, unsigned int *sampling_rate)
+{
+	struct shm_data *shm = data;
+	struct compress_shm_req req = { .cmd = COMPRESS_SHM_GET_TSTAMP };
+	struct compress_shm_resp resp;
+	int ret;
+
+	ret = shm_ctl(shm, &req, &resp);
+	if (ret < 0)
+		return ret;
+
+	*samples = resp.tstamp.samples;
+	*sampling_rate = resp.tstamp.sampling_rate;
+	return 0;
+}
+
+static int shm_start(void *data)
+{
+	struct shm_data *shm = data;
+	int ret;
+
+	ret = shm_simple_ctl(shm, COMPRESS_SHM_START);
+	if (ret == 0)
+		shm->running = 1;
+	return ret;
+}
+
+static int shm_stop(void *data)
+{
+	struct shm_data *shm = data;
+	int ret;
+
+	ret = shm_simple_ctl(shm, COMPRESS_SHM_STOP);
+	if (ret == 0)
+		shm->running = 0;
+	return ret;
+}
+
+static int shm_pause(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm_simple_ctl(shm, COMPRESS_SHM_PAUSE);
+}
+
+static int shm_resume(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm_simple_ctl(shm, COMPRESS_SHM_RESUME);
+}
+
+static int shm_drain(void *data)
+{
+	struct shm_data *shm = data;
+	int ret;
+
+	/* a full drain leaves the stream set up but stopped */
+	ret = shm_simple_ctl(shm, COMPRESS_SHM_DRAIN);
+	if (ret == 0)
+		shm->running = 0;
+	return ret;
+}
+
+static int shm_partial_drain(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm_simple_ctl(shm, COMPRESS_SHM_PARTIAL_DRAIN);
+}
+
+static int shm_next_track(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm_simple_ctl(shm, COMPRESS_SHM_NEXT_TRACK);
+}
+
+static int shm_set_gapless_metadata(void *data,
+		struct compr_gapless_mdata *mdata)
+{
+	struct shm_data *shm = data;
+	struct compress_shm_req req = {
+		.cmd = COMPRESS_SHM_SET_GAPLESS_METADATA,
+	};
+	struct compress_shm_resp resp;
+
+	req.mdata = *mdata;
+	return shm_ctl(shm, &req, &resp);
+}
+
+static void shm_set_max_poll_wait(void *data, int milliseconds)
+{
+	struct shm_data *shm = data;
+
+	shm->max_poll_wait_ms = milliseconds;
+}
+
+static void shm_set_nonblock(void *data, int nonblock)
+{
+	struct shm_data *shm = data;
+
+	shm->nonblocking = !!nonblock;
+}
+
+static int shm_wait(void *data, int timeout_ms)
+{
+	struct shm_data *shm = data;
+	uint32_t len;
+	char *ptr;
+	int efd, ret;
+
+	if (shm->flags & COMPRESS_IN) {
+		len = compress_shm_ring_reserve(shm->ring, shm->ring_size, &ptr);
+		efd = shm->fds[COMPRESS_SHM_FD_SPACE];
+	} else {
+		len = compress_shm_ring_peek(shm->ring, shm->ring_size, &ptr);
+		efd = shm->fds[COMPRESS_SHM_FD_DATA];
+	}
+	if (len)
+		return 0;
+
+	ret = shm_wait_efd(shm, efd, timeout_ms);
+	if (ret == 0)
+		return shm_oops(shm, ETIME, "poll timed out");
+	return ret < 0 ? ret : 0;
+}
+
+static bool shm_is_codec_supported_by_name(const char *name,
+		unsigned int flags, struct snd_codec *codec)
+{
+	struct compress_shm_req req = {
+		.cmd = COMPRESS_SHM_IS_CODEC_SUPPORTED,
+	};
+	struct compress_shm_resp resp;
+	int sock, ret;
+
+	sock = shm_connect(name);
+	if (sock < 0)
+		return false;
+
+	req.open.flags = flags;
+	memcpy(&req.open.codec, codec, sizeof(req.open.codec));
+	ret = shm_transact(sock, &req, &resp, NULL);
+	close(sock);
+
+	return ret == 0 && resp.ret > 0;
+}
+
+static int shm_is_running(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm->running;
+}
+
+static int shm_is_ready(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm->sock >= 0 && !shm->lost;
+}
+
+static const char *shm_get_error(void *data)
+{
+	struct shm_data *shm = data;
+
+	return shm->error;
+}
+
+static int shm_set_codec_params(void *data, struct snd_codec *codec)
+{
+	struct shm_data *shm = data;
+	struct compress_shm_req req = {
+		.cmd = COMPRESS_SHM_SET_CODEC_PARAMS,
+	};
+	struct compress_shm_resp resp;
+
+	memcpy(&req.codec, codec, sizeof(req.codec));
+	return shm_ctl(shm, &req, &resp);
+}
+
+static struct compress_ops shm_ops = {
+	.magic = COMPRESS_OPS_V2,
+	.open_by_name = shm_open_by_name,
+	.close = shm_close,
+	.get_hpointer = shm_get_hpointer,
+	.get_tstamp = shm_get_tstamp,
+	.write = shm_write,
+	.read = shm_read,
+	.start = shm_start,
+	.stop = shm_stop,
+	.pause = shm_pause,
+	.resume = shm_resume,
+	.drain = shm_drain,
+	.partial_drain = shm_partial_drain,
+	.next_track = shm_next_track,
+	.set_gapless_metadata = shm_set_gapless_metadata,
+	.set_max_poll_wait = shm_set_max_poll_wait,
+	.set_nonblock = shm_set_nonblock,
+	.wait = shm_wait,
+	.is_codec_supported_by_name = shm_is_codec_supported_by_name,
+	.is_compress_running = shm_is_running,
+	.is_compress_ready = shm_is_ready,
+	.get_error = shm_get_error,
+	.set_codec_params = shm_set_codec_params,
+};
+
+COMPRESS_PLUGIN_DEFINE(shm, shm_ops);
@@ -0,0 +1,520 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * tee plugin: forwards every op to an inner compress node and keeps a
+ * copy of the bytes exchanged with it in a dump file.
+ *
+ * Name format is 'tee:<inner name>,<dump path>', e.g.
+ * 'tee:hw:0,1,/tmp/dump.bin'. The dump path starts after the last comma.
+ *
+ * The stream thread only copies data into a single producer/single
+ * consumer ring, a background thread drains it to disk. When the disk
+ * cannot keep up the ring overflows and the excess bytes are counted as
+ * dropped instead of stalling the stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include "tinycompress/tinycompress.h"
+#include "tinycompress/compress_ops.h"
+
+#define TEE_RING_MIN_SIZE	(64 * 1024)
+
+struct tee_data {
+	struct compress *inner;
+	int fd;
+
+	char *ring;
+	size_t ring_mask;
+	atomic_size_t head;		/* written by the stream thread */
+	atomic_size_t tail;		/* written by the dump thread */
+	atomic_ullong dropped;
+
+	sem_t kick;
+	atomic_int stop;
+	pthread_t thread;
+
+	/* low watermark notifier of the outer stream */
+	void (*lwm_notify)(void *arg, unsigned long long queued_us);
+	void *lwm_arg;
+};
+
+/* split 'tee:<inner>,<path>' into freshly allocated inner name and path */
+static int tee_parse_name(const char *name, char **inner, char **path)
+{
+	const char *s, *comma;
+
+	s = strchr(name, ':');
+	if (!s)
+		return -EINVAL;
+	s++;
+
+	comma = strrchr(s, ',');
+	if (!comma || comma == s || comma[1] == '\0')
+		return -EINVAL;
+
+	*inner = strndup(s, comma - s);
+	*path = strdup(comma + 1);
+	if (!*inner || !*path) {
+		free(*inner);
+		free(*path);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void tee_push(struct tee_data *tee, const void *buf, size_t size)
+{
+	size_t head = atomic_load_explicit(&tee->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&tee->tail, memory_order_acquire);
+	size_t space = tee->ring_mask + 1 - (head - tail);
+	size_t off, len;
+
+	if (size > space) {
+		atomic_fetch_add_explicit(&tee->dropped, size - space,
+					  memory_order_relaxed);
+		size = space;
+	}
+	if (!size)
+		return;
+
+	off = head & tee->ring_mask;
+	len = tee->ring_mask + 1 - off;
+	if (len > size)
+		len = size;
+	memcpy(tee->ring + off, buf, len);
+	memcpy(tee->ring, (const char *)buf + len, size - len);
+
+	atomic_store_explicit(&tee->head, head + size, memory_order_release);
+	sem_post(&tee->kick);
+}
+
+static void *tee_dump_thread(void *arg)
+{
+	struct tee_data *tee = arg;
+	size_t head, tail, off, len;
+	ssize_t ret;
+
+	for (;;) {
+		sem_wait(&tee->kick);
+
+		tail = atomic_load_explicit(&tee->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&tee->head, memory_order_acquire);
+		while (head != tail) {
+			off = tail & tee->ring_mask;
+			len = tee->ring_mask + 1 - off;
+			if (len > head - tail)
+				len = head - tail;
+
+			ret = write(tee->fd, tee->ring + off, len);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				/* keep draining so the stream never stalls */
+				ret = len;
+			}
+			tail += ret;
+			atomic_store_explicit(&tee->tail, tail,
+					      memory_order_release);
+		}
+
+		if (atomic_load(&tee->stop))
+			break;
+	}
+	return NULL;
+}
+
+static void *tee_open_by_name(const char *name,
+		unsigned int flags, struct compr_config *config)
+{
+	struct tee_data *tee;
+	char *inner_name, *path;
+	size_t size;
+
+	if (tee_parse_name(name, &inner_name, &path))
+		return NULL;
+
+	tee = calloc(1, sizeof(*tee));
+	if (!tee)
+		goto name_fail;
+
+	tee->inner = compress_open_by_name(inner_name, flags, config);
+	if (!tee->inner || !is_compress_ready(tee->inner))
+		goto inner_fail;
+
+	tee->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tee->fd < 0)
+		goto inner_fail;
+
+	/* room for a few full device buffers */
+	size = TEE_RING_MIN_SIZE;
+	while (size < 4ULL * config->fragments * config->fragment_size)
+		size <<= 1;
+	tee->ring = malloc(size);
+	if (!tee->ring)
+		goto fd_fail;
+	tee->ring_mask = size - 1;
+
+	if (sem_init(&tee->kick, 0, 0))
+		goto ring_fail;
+	if (pthread_create(&tee->thread, NULL, tee_dump_thread, tee))
+		goto sem_fail;
+
+	free(inner_name);
+	free(path);
+	return tee;
+
+sem_fail:
+	sem_destroy(&tee->kick);
+ring_fail:
+	free(tee->ring);
+fd_fail:
+	close(tee->fd);
+inner_fail:
+	if (tee->inner)
+		compress_close(tee->inner);
+	free(tee);
+name_fail:
+	free(inner_name);
+	free(path);
+	return NULL;
+}
+
+static void tee_close(void *data)
+{
+	struct tee_data *tee = data;
+	unsigned long long dropped;
+
+	atomic_store(&tee->stop, 1);
+	sem_post(&tee->kick);
+	pthread_join(tee->thread, NULL);
+
+	dropped = atomic_load(&tee->dropped);
+	if (dropped)
+		fprintf(stderr, "%s: dump dropped %llu bytes\n", __func__, dropped);
+
+	sem_destroy(&tee->kick);
+	free(tee->ring);
+	close(tee->fd);
+	compress_close(tee->inner);
+	free(tee);
+}
+
+static int tee_get_hpointer(void *data,
+		unsigned long long *avail, struct timespec *tstamp)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_hpointer64(tee->inner, avail, tstamp);
+}
+
+static int tee_get_tstamp(void *data,
+		unsigned long long *samples, unsigned int *sampling_rate)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_tstamp64(tee->inner, samples, sampling_rate);
+}
+
+static int tee_write(void *data, const void *buf, size_t size)
+{
+	struct tee_data *tee = data;
+	int ret;
+
+	ret = compress_write(tee->inner, buf, size);
+	if (ret > 0)
+		tee_push(tee, buf, ret);
+	return ret;
+}
+
+static int tee_read(void *data, void *buf, size_t size)
+{
+	struct tee_data *tee = data;
+	int ret;
+
+	ret = compress_read(tee->inner, buf, size);
+	if (ret > 0)
+		tee_push(tee, buf, ret);
+	return ret;
+}
+
+static int tee_start(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_start(tee->inner);
+}
+
+static int tee_stop(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_stop(tee->inner);
+}
+
+static int tee_pause(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_pause(tee->inner);
+}
+
+static int tee_resume(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_resume(tee->inner);
+}
+
+static int tee_drain(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_drain(tee->inner);
+}
+
+static int tee_partial_drain(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_partial_drain(tee->inner);
+}
+
+static int tee_next_track(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_next_track(tee->inner);
+}
+
+static int tee_set_gapless_metadata(void *data,
+		struct compr_gapless_mdata *mdata)
+{
+	struct tee_data *tee = data;
+
+	return compress_set_gapless_metadata(tee->inner, mdata);
+}
+
+static void tee_set_max_poll_wait(void *data, int milliseconds)
+{
+	struct tee_data *tee = data;
+
+	compress_set_max_poll_wait(tee->inner, milliseconds);
+}
+
+static void tee_set_nonblock(void *data, int nonblock)
+{
+	struct tee_data *tee = data;
+
+	compress_nonblock(tee->inner, nonblock);
+}
+
+static int tee_wait(void *data, int timeout_ms)
+{
+	struct tee_data *tee = data;
+
+	return compress_wait(tee->inner, timeout_ms);
+}
+
+static bool tee_is_codec_supported_by_name(const char *name,
+		unsigned int flags, struct snd_codec *codec)
+{
+	char *inner_name, *path;
+	bool ret;
+
+	if (tee_parse_name(name, &inner_name, &path))
+		return false;
+
+	ret = is_codec_supported_by_name(inner_name, flags, codec);
+
+	free(inner_name);
+	free(path);
+	return ret;
+}
+
+static int tee_is_running(void *data)
+{
+	struct tee_data *tee = data;
+
+	return is_compress_running(tee->inner);
+}
+
+static int tee_is_ready(void *data)
+{
+	struct tee_data *tee = data;
+
+	return is_compress_ready(tee->inner);
+}
+
+static const char *tee_get_error(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_error(tee->inner);
+}
+
+static int tee_set_codec_params(void *data, struct snd_codec *codec)
+{
+	struct tee_data *tee = data;
+
+	return compress_set_codec_params(tee->inner, codec);
+}
+
+static int tee_writev(void *data, const struct iovec *iov, int iovcnt)
+{
+	struct tee_data *tee = data;
+	size_t left;
+	int ret, i;
+
+	ret = compress_writev(tee->inner, iov, iovcnt);
+	if (ret <= 0)
+		return ret;
+
+	left = ret;
+	for (i = 0; i < iovcnt && left; i++) {
+		size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+
+		tee_push(tee, iov[i].iov_base, len);
+		left -= len;
+	}
+	return ret;
+}
+
+static int tee_get_poll_fd(void *data)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_poll_fd(tee->inner);
+}
+
+static int tee_get_caps(void *data, struct snd_compr_caps *caps)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_caps(tee->inner, caps);
+}
+
+static int tee_queue_next_track(void *data, struct snd_codec *codec,
+		struct compr_gapless_mdata *mdata)
+{
+	struct tee_data *tee = data;
+
+	return compress_queue_next_track(tee->inner, codec, mdata);
+}
+
+static int tee_get_metadata(void *data, struct compr_gapless_mdata *mdata)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_metadata(tee->inner, mdata);
+}
+
+static int tee_get_codec_params(void *data, struct snd_codec *codec)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_codec_params(tee->inner, codec);
+}
+
+static int tee_set_adaptive_poll(void *data, int enable)
+{
+	struct tee_data *tee = data;
+
+	return compress_set_adaptive_poll(tee->inner, enable);
+}
+
+static int tee_get_snapshot(void *data, struct compress_snapshot *snapshot)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_snapshot(tee->inner, snapshot);
+}
+
+static int tee_reconfigure(void *data, struct compr_config *config)
+{
+	struct tee_data *tee = data;
+
+	return compress_reconfigure(tee->inner, config);
+}
+
+static int tee_get_stats(void *data, struct compress_stats *stats)
+{
+	struct tee_data *tee = data;
+
+	return compress_get_stats(tee->inner, stats);
+}
+
+static void tee_low_watermark(struct compress *inner,
+		unsigned long long queued_us, void *arg)
+{
+	struct tee_data *tee = arg;
+
+	(void)inner;
+	tee->lwm_notify(tee->lwm_arg, queued_us);
+}
+
+static int tee_set_low_watermark(void *data, unsigned int threshold_us,
+		void (*notify)(void *arg, unsigned long long queued_us),
+		void *arg)
+{
+	struct tee_data *tee = data;
+
+	tee->lwm_notify = notify;
+	tee->lwm_arg = arg;
+	return compress_set_low_watermark(tee->inner, threshold_us,
+			notify ? tee_low_watermark : NULL, tee);
+}
+
+static struct compress_ops tee_ops = {
+	.magic = COMPRESS_OPS_V3,
+	.open_by_name = tee_open_by_name,
+	.close = tee_close,
+	.get_hpointer = tee_get_hpointer,
+	.get_tstamp = tee_get_tstamp,
+	.write = tee_write,
+	.read = tee_read,
+	.start = tee_start,
+	.stop = tee_stop,
+	.pause = tee_pause,
+	.resume = tee_resume,
+	.drain = tee_drain,
+	.partial_drain = tee_partial_drain,
+	.next_track = tee_next_track,
+	.set_gapless_metadata = tee_set_gapless_metadata,
+	.set_max_poll_wait = tee_set_max_poll_wait,
+	.set_nonblock = tee_set_nonblock,
+	.wait = tee_wait,
+	.is_codec_supported_by_name = tee_is_codec_supported_by_name,
+	.is_compress_running = tee_is_running,
+	.is_compress_ready = tee_is_ready,
+	.get_error = tee_get_error,
+	.set_codec_params = tee_set_codec_params,
+	.size = sizeof(struct compress_ops),
+	.features = COMPRESS_OPS_F_WRITEV | COMPRESS_OPS_F_POLL_FD |
+		    COMPRESS_OPS_F_CAPS | COMPRESS_OPS_F_QUEUE_NEXT_TRACK |
+		    COMPRESS_OPS_F_READBACK | COMPRESS_OPS_F_ADAPTIVE_POLL |
+		    COMPRESS_OPS_F_SNAPSHOT | COMPRESS_OPS_F_RECONFIGURE |
+		    COMPRESS_OPS_F_STATS | COMPRESS_OPS_F_LOW_WATERMARK,
+	.writev = tee_writev,
+	.get_poll_fd = tee_get_poll_fd,
+	.get_caps = tee_get_caps,
+	.queue_next_track = tee_queue_next_track,
+	.get_metadata = tee_get_metadata,
+	.get_codec_params = tee_get_codec_params,
+	.set_adaptive_poll = tee_set_adaptive_poll,
+	.get_snapshot = tee_get_snapshot,
+	.reconfigure = tee_reconfigure,
+	.get_stats = tee_get_stats,
+	.set_low_watermark = tee_set_low_watermark,
+};
+
+COMPRESS_PLUGIN_DEFINE(tee, tee_ops);
@@ -23,11 +23,12 @@
 #include <libavcodec/avcodec.h>
 
 static int verbose;
+static unsigned int start_frags;
 
 enum continuous_playback_mode {
 	PLAYBACK_MODE_NOP     = 0, /* sequential: files are streamed continuously */
 	PLAYBACK_MODE_GAPLESS = 1, /* gapless: uses kernel gapless API */
-	PLAYBACK_MODE_RESTART = 2, /* restart: compress device is drained, closed and reopened between tracks */
+	PLAYBACK_MODE_RESTART = 2, /* restart: compress device is drained and reconfigured between tracks */
 };
 
 static const struct {
@@ -67,8 +68,9 @@ static void usage(void)
 		"-p\tcontinuous playback mode:\n"
 		"\t  0 = NOP (default): files streamed continuously\n"
 		"\t  1 = gapless: kernel gapless API, no audible gap\n"
-		"\t  2 = restart: compress device drained and reopened between tracks\n"
+		"\t  2 = restart: compress device drained and reconfigured between tracks\n"
 		"-g\t(deprecated) equivalent to -p 0/1\n"
+		"-s\tfast start: fragments to prefill before starting\n"
 		"-v\tverbose mode\n"
 		"-h\tPrints this help list\n\n"
 		"Example:\n"
@@ -120,7 +122,7 @@ int main(int argc, char **argv)
 		usage();
 
 	verbose = 0;
-	while ((c = getopt(argc, argv, "hvb:f:c:d:I:g:p:")) != -1) {
+	while ((c = getopt(argc, argv, "hvb:f:c:d:I:g:p:s:")) != -1) {
 		switch (c) {
 		case 'h':
 			usage();
@@ -143,6 +145,9 @@ int main(int argc, char **argv)
 		case 'p':
 			pb_mode = strtol(optarg, NULL, 10);
 			break;
+		case 's':
+			start_frags = strtol(optarg, NULL, 10);
+			break;
 		case 'I':
 			if (optarg[0] == '0') {
 				codec_id = strtol(optarg, NULL, 0);
@@ -348,16 +353,40 @@ exit:
 
 }
 
+/* write a full buffer of data before the stream is started */
+static int compress_prefill(struct compress *compress, FILE *file,
+			    char *buffer, int size)
+{
+	int num_read, wrote;
+
+	num_read = fread(buffer, 1, size, file);
+	if (num_read > 0) {
+		if (verbose)
+			printf("%s: Doing first buffer write of %d\n", __func__, num_read);
+		wrote = compress_write(compress, buffer, num_read);
+		if (wrote < 0) {
+			fprintf(stderr, "Error %d playing sample\n", wrote);
+			fprintf(stderr, "ERR: %s\n", compress_get_error(compress));
+			return -1;
+		}
+		if (wrote != num_read) {
+			/* TODO: Buufer pointer needs to be set here */
+			fprintf(stderr, "We wrote %d, DSP accepted %d\n", num_read, wrote);
+		}
+	}
+	return 0;
+}
+
 static struct compress *
 compress_open_and_prepare(unsigned int card, unsigned int device,
 			  struct snd_codec *codec, unsigned long buffer_size,
 			  const char *name, FILE *file, char **buffer_out,
-			  int *size_out)
+			  int *size_out, int *bytes_out)
 {
 	struct compr_config config;
 	struct compress *compress;
-	int size, num_read, wrote;
 	char *buffer;
+	int size;
 
 	memset(&config, 0, sizeof(config));
 
@@ -372,9 +401,12 @@ compress_open_and_prepare(unsigned int card, unsigned int device,
 	}
 	if (verbose)
 		printf("%s: Opened compress device\n", __func__);
+	if (start_frags)
+		compress_set_start_threshold(compress,
+				start_frags * config.fragment_size);
 
 	size = config.fragment_size;
-	buffer = malloc(size * config.fragments);
+	buffer = compress_alloc_buffer(compress, COMPRESS_BUFFER_MLOCK);
 	if (!buffer) {
 		fprintf(stderr, "Unable to allocate %d bytes\n",
 			size * config.fragments);
@@ -383,26 +415,15 @@ compress_open_and_prepare(unsigned int card, unsigned int device,
 	}
 
 	/* write full buffer data initially */
-	num_read = fread(buffer, 1, size * config.fragments, file);
-	if (num_read > 0) {
-		if (verbose)
-			printf("%s: Doing first buffer write of %d\n", __func__, num_read);
-		wrote = compress_write(compress, buffer, num_read);
-		if (wrote < 0) {
-			fprintf(stderr, "Error %d playing sample\n", wrote);
-			fprintf(stderr, "ERR: %s\n", compress_get_error(compress));
-			free(buffer);
-			compress_close(compress);
-			return NULL;
-		}
-		if (wrote != num_read) {
-			/* TODO: Buufer pointer needs to be set here */
-			fprintf(stderr, "We wrote %d, DSP accepted %d\n", num_read, wrote);
-		}
+	if (compress_prefill(compress, file, buffer, size * config.fragments)) {
+		compress_free_buffer(buffer);
+		compress_close(compress);
+		return NULL;
 	}
 
 	*buffer_out = buffer;
 	*size_out = size;
+	*bytes_out = size * config.fragments;
 	return compress;
 }
 
@@ -413,7 +434,7 @@ void play_samples(char **files, unsigned int card, unsigned int device,
 {
 	struct compr_gapless_mdata mdata;
 	struct compress *compress;
-	int size, num_read, wrote;
+	int size, bytes, num_read, wrote;
 	unsigned int file_idx = 0;
 	struct snd_codec codec;
 	char *buffer, *name;
@@ -428,7 +449,7 @@ void play_samples(char **files, unsigned int card, unsigned int device,
 
 	parse_file(name, &codec);
 	compress = compress_open_and_prepare(card, device, &codec, buffer_size,
-					     name, file, &buffer, &size);
+					     name, file, &buffer, &size, &bytes);
 	if (!compress)
 		goto FILE_EXIT;
 
@@ -462,34 +483,52 @@ void play_samples(char **files, unsigned int card, unsigned int device,
 
 				parse_file(name, &codec);
 
-				rc = compress_set_gapless_metadata(compress, &mdata);
-				if (rc)
-					fprintf(stderr, "ERR: set gapless metadata\n");
-
-				rc = compress_next_track(compress);
-				if (rc)
-					fprintf(stderr, "ERR: compress next track set\n");
-
-				rc = compress_set_codec_params(compress, &codec);
+				rc = compress_queue_next_track(compress, &codec, &mdata);
 				if (rc)
-					fprintf(stderr, "ERR: set next track codec params\n");
+					fprintf(stderr, "ERR: queue next track: %s\n",
+						compress_get_error(compress));
 
 				/* issue partial drain if it supports */
 				rc = compress_partial_drain(compress);
 				if (rc)
 					fprintf(stderr, "ERR: partial drain\n");
 			} else if (pb_mode == PLAYBACK_MODE_RESTART) {
-				/* restart: drain, close, and reopen for the new file */
-				compress_drain(compress);
-				compress_close(compress);
-				free(buffer);
+				struct compr_config config;
 
+				/* restart: drain and set up the device for the new file */
+				compress_drain(compress);
 				parse_file(name, &codec);
-				compress = compress_open_and_prepare(card, device, &codec,
-								     buffer_size, name,
-								     file, &buffer, &size);
-				if (!compress)
-					goto FILE_EXIT;
+
+				memset(&config, 0, sizeof(config));
+				config.codec = &codec;
+				if (compress_reconfigure(compress, &config) == 0) {
+					/* keep the buffer unless the layout changed */
+					if (config.fragment_size * config.fragments !=
+					    (unsigned int)bytes) {
+						compress_free_buffer(buffer);
+						buffer = compress_alloc_buffer(compress,
+								COMPRESS_BUFFER_MLOCK);
+						if (!buffer)
+							goto BUF_EXIT;
+						bytes = config.fragment_size *
+							config.fragments;
+					}
+					size = config.fragment_size;
+					if (compress_prefill(compress, file, buffer,
+							     config.fragment_size *
+							     config.fragments))
+						goto BUF_EXIT;
+				} else {
+					/* backend can't reconfigure, reopen it */
+					compress_close(compress);
+					compress_free_buffer(buffer);
+
+					compress = compress_open_and_prepare(card, device, &codec,
+									     buffer_size, name,
+									     file, &buffer, &size, &bytes);
+					if (!compress)
+						goto FILE_EXIT;
+				}
 
 				printf("Playing file %s On Card %u device %u, with buffer of %lu bytes\n",
 					name, card, device, buffer_size);
@@ -533,7 +572,7 @@ void play_samples(char **files, unsigned int card, unsigned int device,
 	if (verbose)
 		printf("%s: exit success\n", __func__);
 	/* issue drain if it supports */
-	free(buffer);
+	compress_free_buffer(buffer);
 	compress_close(compress);
 	return;
 
@@ -541,7 +580,7 @@ TRACK_EXIT:
 	if (verbose)
 		printf("%s: exit track\n", __func__);
 BUF_EXIT:
-	free(buffer);
+	compress_free_buffer(buffer);
 	compress_close(compress);
 FILE_EXIT:
 	fclose(file);
@@ -86,6 +86,7 @@ enum {
 };
 
 static int verbose, interactive;
+static unsigned int start_frags;
 static bool is_paused = false;
 static long term_c_lflag = -1, stdin_flags = -1;
 
@@ -215,7 +216,8 @@ static void usage(void)
 		"-d\tdevice node\n"
 		"-I\tspecify codec ID (default is mp3)\n"
 		"-b\tbuffer size\n"
-		"-f\tfragments\n\n"
+		"-f\tfragments\n"
+		"-s\tfast start: fragments to prefill before starting\n\n"
 		"-v\tverbose mode\n"
 		"-i\tinteractive mode (press SPACE or ENTER for play/pause)\n"
 		"-h\tPrints this help list\n\n"
@@ -459,6 +461,17 @@ static int print_time(struct compress *compress)
 	return 0;
 }
 
+static void print_startup_latency(struct compress *compress)
+{
+	struct compress_startup_latency latency;
+
+	if (compress_get_startup_latency(compress, &latency) != 0)
+		return;
+	printf("Startup: prefill %llu bytes in %llu us, first audio %llu us after start, %llu us total\n",
+	       latency.prefill_bytes, latency.prefill_ns / 1000,
+	       latency.start_ns / 1000, latency.total_ns / 1000);
+}
+
 int main(int argc, char **argv)
 {
 	char *file;
@@ -471,7 +484,7 @@ int main(int argc, char **argv)
 		usage();
 
 	verbose = 0;
-	while ((c = getopt(argc, argv, "hvb:f:c:d:I:i")) != -1) {
+	while ((c = getopt(argc, argv, "hvb:f:c:d:I:is:")) != -1) {
 		switch (c) {
 		case 'h':
 			usage();
@@ -514,6 +527,9 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Interactive mode: ON\n");
 			interactive = 1;
 			break;
+		case 's':
+			start_frags = strtol(optarg, NULL, 10);
+			break;
 		default:
 			exit(EXIT_FAILURE);
 		}
@@ -821,8 +837,11 @@ void play_samples(char *name, unsigned int card, unsigned int device,
 	};
 	if (verbose)
 		printf("%s: Opened compress device\n", __func__);
+	if (start_frags)
+		compress_set_start_threshold(compress,
+				start_frags * config.fragment_size);
 	size = config.fragments * config.fragment_size;
-	buffer = malloc(size);
+	buffer = compress_alloc_buffer(compress, COMPRESS_BUFFER_MLOCK);
 	if (!buffer) {
 		fprintf(stderr, "Unable to allocate %d bytes\n", size);
 		goto COMP_EXIT;
@@ -880,17 +899,19 @@ void play_samples(char *name, unsigned int card, unsigned int device,
 		}
 	} while (num_read > 0 || is_paused == true);
 
-	if (verbose)
+	if (verbose) {
+		print_startup_latency(compress);
 		printf("%s: exit success\n", __func__);
+	}
 	/* issue drain if it supports */
 	compress_drain(compress);
-	free(buffer);
+	compress_free_buffer(buffer);
 	fclose(file);
 	compress_close(compress);
 	done_stdin();
 	return;
 BUF_EXIT:
-	free(buffer);
+	compress_free_buffer(buffer);
 COMP_EXIT:
 	compress_close(compress);
 	done_stdin();
@@ -305,7 +305,7 @@ static void capture_samples(char *name, unsigned int card, unsigned int device,
 		fprintf(finfo, "%s: Opened compress device\n", __func__);
 
 	size = config.fragments * config.fragment_size;
-	buffer = malloc(size);
+	buffer = compress_alloc_buffer(compress, COMPRESS_BUFFER_MLOCK);
 	if (!buffer) {
 		fprintf(stderr, "Unable to allocate %d bytes\n", size);
 		goto comp_exit;
@@ -364,7 +364,7 @@ static void capture_samples(char *name, unsigned int card, unsigned int device,
 	if (verbose)
 		fprintf(finfo, "%s: exit success\n", __func__);
 
-	free(buffer);
+	compress_free_buffer(buffer);
 	close(file);
 	file = 0;
 
@@ -372,7 +372,7 @@ static void capture_samples(char *name, unsigned int card, unsigned int device,
 
 	return;
 buf_exit:
-	free(buffer);
+	compress_free_buffer(buffer);
 comp_exit:
 	compress_close(compress);
 file_exit:
@@ -0,0 +1,538 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * cshmd: host a compress stream on behalf of shm plugin clients.
+ *
+ * The daemon owns the compress device and serves one client at a time
+ * on a SOCK_SEQPACKET UNIX socket. Stream data is exchanged through a
+ * memfd-backed ring shared with the client, see compress_shm.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define __force
+#define __bitwise
+#define __user
+#include "sound/compress_params.h"
+#include "tinycompress/tinycompress.h"
+#include "tinycompress/compress_shm.h"
+
+#define CSHMD_MIN_RING_SIZE	4096
+#define CSHMD_MAX_RING_SIZE	(64U << 20)
+#define CSHMD_RETRY_MS		10
+
+static int verbose;
+
+struct cshmd_stream {
+	struct compress *compress;
+	unsigned int flags;
+	struct compress_shm_ring *ring;
+	size_t map_size;
+	uint32_t ring_size;
+	int fds[COMPRESS_SHM_NUM_FDS];
+	int dev_fd;		/* compress poll descriptor, -1 if none */
+	int dev_stalled;	/* device signalled POLLERR, stop polling it */
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: cshmd [OPTIONS] -s socket\n"
+		"-c\tcard number\n"
+		"-d\tdevice node\n"
+		"-D\tcompress node name (overrides -c/-d)\n"
+		"-s\tpath of the UNIX socket to listen on\n"
+		"-v\tverbose mode\n"
+		"-h\tPrints this help list\n\n"
+		"Example:\n"
+		"\tcshmd -c 1 -d 2 -s /run/cshmd.sock\n"
+		"\tcplay-like clients then open 'shm:/run/cshmd.sock'\n");
+
+	exit(EXIT_FAILURE);
+}
+
+static void kick(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0) {
+		/* counter saturated, the peer is already signalled */
+	}
+}
+
+static void ack(int efd)
+{
+	uint64_t cnt;
+
+	if (read(efd, &cnt, sizeof(cnt)) < 0) {
+		/* nothing pending */
+	}
+}
+
+static int send_resp(int sock, struct compress_shm_resp *resp, int *fds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * COMPRESS_SHM_NUM_FDS)];
+	struct iovec iov = { resp, sizeof(*resp) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+
+	if (fds) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * COMPRESS_SHM_NUM_FDS);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * COMPRESS_SHM_NUM_FDS);
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*resp) ? 0 : -1;
+}
+
+static void resp_error(struct cshmd_stream *st, struct compress_shm_resp *resp,
+		int ret)
+{
+	resp->ret = ret;
+	if (ret >= 0)
+		return;
+
+	resp->err = errno;
+	if (st->compress)
+		snprintf(resp->error, sizeof(resp->error), "%s",
+			 compress_get_error(st->compress));
+	else
+		snprintf(resp->error, sizeof(resp->error), "%s",
+			 strerror(resp->err));
+}
+
+/*
+ * Move queued client data into the device. In blocking mode this only
+ * returns once the ring is empty or the device refused data.
+ */
+static void pump_playback(struct cshmd_stream *st, int blocking)
+{
+	int moved = 0, ret;
+	uint32_t len;
+	char *ptr;
+
+	if (blocking)
+		compress_nonblock(st->compress, 0);
+
+	while ((len = compress_shm_ring_peek(st->ring, st->ring_size, &ptr))) {
+		ret = compress_write(st->compress, ptr, len);
+		if (ret <= 0)
+			break;
+		compress_shm_ring_consume(st->ring, ret);
+		moved = 1;
+	}
+
+	if (blocking)
+		compress_nonblock(st->compress, 1);
+	if (moved)
+		kick(st->fds[COMPRESS_SHM_FD_SPACE]);
+}
+
+/* Move captured data from the device into the ring */
+static void pump_capture(struct cshmd_stream *st)
+{
+	int moved = 0, ret;
+	uint32_t len;
+	char *ptr;
+
+	while ((len = compress_shm_ring_reserve(st->ring, st->ring_size, &ptr))) {
+		ret = compress_read(st->compress, ptr, len);
+		if (ret <= 0)
+			break;
+		compress_shm_ring_commit(st->ring, ret);
+		moved = 1;
+	}
+
+	if (moved)
+		kick(st->fds[COMPRESS_SHM_FD_DATA]);
+}
+
+static void stream_close(struct cshmd_stream *st)
+{
+	int i;
+
+	if (!st->compress)
+		return;
+
+	compress_close(st->compress);
+	munmap(st->ring, st->map_size);
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		close(st->fds[i]);
+	memset(st, 0, sizeof(*st));
+	st->dev_fd = -1;
+}
+
+static int stream_open(struct cshmd_stream *st, const char *name,
+		struct compress_shm_req *req, struct compress_shm_resp *resp)
+{
+	struct compr_config config;
+	struct snd_codec codec;
+	uint32_t size;
+	int i;
+
+	if (st->compress) {
+		errno = EBUSY;
+		return -1;
+	}
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		st->fds[i] = -1;
+
+	memcpy(&codec, &req->open.codec, sizeof(codec));
+	config.fragment_size = req->open.fragment_size;
+	config.fragments = req->open.fragments;
+	config.codec = &codec;
+
+	st->compress = compress_open_by_name(name, req->open.flags, &config);
+	if (!st->compress || !is_compress_ready(st->compress)) {
+		snprintf(resp->error, sizeof(resp->error), "%s",
+			 st->compress ? compress_get_error(st->compress) :
+			 "cannot open compress node");
+		if (st->compress)
+			compress_close(st->compress);
+		st->compress = NULL;
+		errno = ENODEV;
+		return -1;
+	}
+	st->flags = req->open.flags;
+
+	/* the fragment config comes from the client */
+	if ((unsigned long long)config.fragments * config.fragment_size >
+	    CSHMD_MAX_RING_SIZE) {
+		snprintf(resp->error, sizeof(resp->error),
+			 "buffer larger than %u bytes", CSHMD_MAX_RING_SIZE);
+		compress_close(st->compress);
+		st->compress = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+
+	size = CSHMD_MIN_RING_SIZE;
+	while (size < config.fragments * config.fragment_size)
+		size <<= 1;
+	st->ring_size = size;
+	st->map_size = sizeof(*st->ring) + size;
+
+	st->fds[COMPRESS_SHM_FD_RING] = memfd_create("cshmd-ring",
+					MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	st->fds[COMPRESS_SHM_FD_DATA] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	st->fds[COMPRESS_SHM_FD_SPACE] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		if (st->fds[i] < 0)
+			goto fail;
+
+	/* a client shrinking the ring would fault the daemon */
+	if (ftruncate(st->fds[COMPRESS_SHM_FD_RING], st->map_size) ||
+	    fcntl(st->fds[COMPRESS_SHM_FD_RING], F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+		goto fail;
+	st->ring = mmap(NULL, st->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, st->fds[COMPRESS_SHM_FD_RING], 0);
+	if (st->ring == MAP_FAILED)
+		goto fail;
+	st->ring->magic = COMPRESS_SHM_MAGIC;
+	st->ring->size = size;
+
+	/* the main loop polls, the stream must never block it */
+	compress_nonblock(st->compress, 1);
+	st->dev_fd = compress_get_poll_fd(st->compress);
+	if (st->dev_fd < 0)
+		st->dev_fd = -1;
+
+	resp->open.fragment_size = config.fragment_size;
+	resp->open.fragments = config.fragments;
+	resp->open.ring_size = size;
+	return 0;
+
+fail:
+	snprintf(resp->error, sizeof(resp->error), "cannot create ring: %s",
+		 strerror(errno));
+	if (st->ring && st->ring != MAP_FAILED)
+		munmap(st->ring, st->map_size);
+	st->ring = NULL;
+	for (i = 0; i < COMPRESS_SHM_NUM_FDS; i++)
+		if (st->fds[i] >= 0)
+			close(st->fds[i]);
+	compress_close(st->compress);
+	st->compress = NULL;
+	return -1;
+}
+
+/* returns 1 when the client asked to close the session */
+static int handle_request(struct cshmd_stream *st, const char *name, int sock,
+		struct compress_shm_req *req)
+{
+	struct compress_shm_resp resp;
+	unsigned long long avail;
+	struct timespec tstamp;
+	struct snd_codec codec;
+	int ret;
+
+	memset(&resp, 0, sizeof(resp));
+
+	if (req->cmd == COMPRESS_SHM_IS_CODEC_SUPPORTED) {
+		memcpy(&codec, &req->open.codec, sizeof(codec));
+		resp.ret = is_codec_supported_by_name(name, req->open.flags,
+						      &codec);
+		send_resp(sock, &resp, NULL);
+		return 0;
+	}
+
+	if (req->cmd == COMPRESS_SHM_OPEN) {
+		ret = stream_open(st, name, req, &resp);
+		resp.ret = ret;
+		if (ret < 0) {
+			resp.err = errno;
+			send_resp(sock, &resp, NULL);
+		} else {
+			send_resp(sock, &resp, st->fds);
+		}
+		return 0;
+	}
+
+	if (!st->compress) {
+		errno = EBADFD;
+		resp_error(st, &resp, -1);
+		send_resp(sock, &resp, NULL);
+		return req->cmd == COMPRESS_SHM_CLOSE;
+	}
+
+	/* any control op may unblock the device again */
+	st->dev_stalled = 0;
+
+	switch (req->cmd) {
+	case COMPRESS_SHM_CLOSE:
+		stream_close(st);
+		send_resp(sock, &resp, NULL);
+		return 1;
+	case COMPRESS_SHM_START:
+		if (st->flags & COMPRESS_IN)
+			pump_playback(st, 0);
+		ret = compress_start(st->compress);
+		break;
+	case COMPRESS_SHM_STOP:
+		ret = compress_stop(st->compress);
+		/* queued data is discarded along with the device buffer */
+		if (ret == 0 && (st->flags & COMPRESS_IN))
+			atomic_store(&st->ring->tail, atomic_load(&st->ring->head));
+		break;
+	case COMPRESS_SHM_PAUSE:
+		ret = compress_pause(st->compress);
+		break;
+	case COMPRESS_SHM_RESUME:
+		ret = compress_resume(st->compress);
+		break;
+	case COMPRESS_SHM_DRAIN:
+		pump_playback(st, 1);
+		ret = compress_drain(st->compress);
+		break;
+	case COMPRESS_SHM_PARTIAL_DRAIN:
+		pump_playback(st, 1);
+		ret = compress_partial_drain(st->compress);
+		break;
+	case COMPRESS_SHM_NEXT_TRACK:
+		/* the track boundary follows everything queued so far */
+		pump_playback(st, 1);
+		ret = compress_next_track(st->compress);
+		break;
+	case COMPRESS_SHM_SET_GAPLESS_METADATA:
+		ret = compress_set_gapless_metadata(st->compress, &req->mdata);
+		break;
+	case COMPRESS_SHM_SET_CODEC_PARAMS:
+		memcpy(&codec, &req->codec, sizeof(codec));
+		ret = compress_set_codec_params(st->compress, &codec);
+		break;
+	case COMPRESS_SHM_GET_HPOINTER:
+		ret = compress_get_hpointer64(st->compress, &avail, &tstamp);
+		if (ret == 0) {
+			/* the client sees the ring as its buffer */
+			if (st->flags & COMPRESS_IN)
+				resp.hpointer.avail = st->ring_size -
+					compress_shm_ring_used(st->ring);
+			else
+				resp.hpointer.avail = compress_shm_ring_used(st->ring);
+			resp.hpointer.tv_sec = tstamp.tv_sec;
+			resp.hpointer.tv_nsec = tstamp.tv_nsec;
+		}
+		break;
+	case COMPRESS_SHM_GET_TSTAMP:
+		ret = compress_get_tstamp64(st->compress, &avail,
+					    &resp.tstamp.sampling_rate);
+		resp.tstamp.samples = avail;
+		break;
+	default:
+		errno = EINVAL;
+		ret = -1;
+		break;
+	}
+
+	resp_error(st, &resp, ret);
+	send_resp(sock, &resp, NULL);
+	return 0;
+}
+
+static void serve_client(int sock, const char *name)
+{
+	struct cshmd_stream st;
+	struct compress_shm_req req;
+	struct pollfd fds[3];
+	int nfds, pending, timeout;
+	ssize_t ret;
+
+	memset(&st, 0, sizeof(st));
+	st.dev_fd = -1;
+
+	for (;;) {
+		nfds = 0;
+		timeout = -1;
+		fds[nfds].fd = sock;
+		fds[nfds++].events = POLLIN;
+
+		if (st.compress) {
+			/* client -> host kick for the direction we consume */
+			fds[nfds].fd = (st.flags & COMPRESS_IN) ?
+				st.fds[COMPRESS_SHM_FD_DATA] :
+				st.fds[COMPRESS_SHM_FD_SPACE];
+			fds[nfds++].events = POLLIN;
+
+			if (st.flags & COMPRESS_IN)
+				pending = compress_shm_ring_used(st.ring) != 0;
+			else
+				pending = compress_shm_ring_used(st.ring) < st.ring_size;
+			if (pending && st.dev_fd >= 0 && !st.dev_stalled) {
+				fds[nfds].fd = st.dev_fd;
+				fds[nfds++].events = (st.flags & COMPRESS_IN) ?
+					POLLOUT : POLLIN;
+			} else if (pending && st.dev_fd < 0) {
+				/* no descriptor to wait on, retry periodically */
+				timeout = CSHMD_RETRY_MS;
+			}
+		}
+
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			ret = recv(sock, &req, sizeof(req), 0);
+			if (ret <= 0)
+				break;
+			if (ret != sizeof(req))
+				continue;
+			if (handle_request(&st, name, sock, &req))
+				break;
+			continue;
+		} else if (fds[0].revents & (POLLHUP | POLLERR)) {
+			break;
+		}
+
+		if (nfds > 1 && (fds[1].revents & POLLIN))
+			ack(fds[1].fd);
+		if (nfds > 2 && (fds[2].revents & POLLERR))
+			st.dev_stalled = 1;
+
+		if (st.flags & COMPRESS_IN)
+			pump_playback(&st, 0);
+		else
+			pump_capture(&st);
+	}
+
+	if (verbose)
+		printf("%s: client gone\n", __func__);
+	stream_close(&st);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int card = 0, device = 0;
+	const char *path = NULL;
+	char name[128] = "";
+	struct sockaddr_un addr;
+	int c, lsock, sock;
+
+	while ((c = getopt(argc, argv, "hvc:d:D:s:")) != -1) {
+		switch (c) {
+		case 'c':
+			card = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			device = strtol(optarg, NULL, 10);
+			break;
+		case 'D':
+			snprintf(name, sizeof(name), "%s", optarg);
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (!path || strlen(path) >= sizeof(addr.sun_path))
+		usage();
+	if (!name[0])
+		snprintf(name, sizeof(name), "hw:%u,%u", card, device);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lsock < 0) {
+		fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lsock, 1)) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (verbose)
+		printf("Hosting %s on %s\n", name, path);
+
+	for (;;) {
+		sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			break;
+		}
+		serve_client(sock, name);
+		close(sock);
+	}
+
+	close(lsock);
+	unlink(path);
+	exit(EXIT_FAILURE);
+}
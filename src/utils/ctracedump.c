@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: (LGPL-2.1-only OR BSD-3-Clause) */
+
+/*
+ * ctracedump: decode a flight recorder dump of compress_dump_trace().
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include "tinycompress/tinytrace.h"
+
+static const char *event_names[TINYTRACE_NUM_EVENTS] = {
+	[TINYTRACE_WRITE] = "write",
+	[TINYTRACE_WRITEV] = "writev",
+	[TINYTRACE_READ] = "read",
+	[TINYTRACE_AVAIL] = "avail",
+	[TINYTRACE_POLL] = "poll",
+	[TINYTRACE_START] = "start",
+	[TINYTRACE_STOP] = "stop",
+	[TINYTRACE_PAUSE] = "pause",
+	[TINYTRACE_RESUME] = "resume",
+	[TINYTRACE_DRAIN] = "drain",
+	[TINYTRACE_PARTIAL_DRAIN] = "partial_drain",
+	[TINYTRACE_NEXT_TRACK] = "next_track",
+	[TINYTRACE_RECONFIGURE] = "reconfigure",
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: ctracedump [OPTIONS] file\n"
+		"-e\tonly print failed calls\n"
+		"-h\tPrints this help list\n\n"
+		"Example:\n"
+		"\tctracedump /tmp/compress.trace\n");
+
+	exit(EXIT_FAILURE);
+}
+
+static void swap_header(struct tinytrace_header *hdr)
+{
+	hdr->magic = __builtin_bswap32(hdr->magic);
+	hdr->version = __builtin_bswap32(hdr->version);
+	hdr->record_size = __builtin_bswap32(hdr->record_size);
+	hdr->count = __builtin_bswap32(hdr->count);
+	hdr->total = __builtin_bswap64(hdr->total);
+	hdr->start_ns = __builtin_bswap64(hdr->start_ns);
+}
+
+static void swap_record(struct tinytrace_record *rec)
+{
+	rec->time_ns = __builtin_bswap64(rec->time_ns);
+	rec->value = __builtin_bswap64(rec->value);
+	rec->result = (int32_t)__builtin_bswap32((uint32_t)rec->result);
+	rec->event = __builtin_bswap32(rec->event);
+}
+
+static void print_record(const struct tinytrace_record *rec,
+		uint64_t start_ns, uint64_t prev_ns)
+{
+	const char *name = NULL;
+	char buf[32];
+
+	if (rec->event < TINYTRACE_NUM_EVENTS)
+		name = event_names[rec->event];
+	if (!name) {
+		snprintf(buf, sizeof(buf), "event%u", rec->event);
+		name = buf;
+	}
+
+	printf("%12.6f %+10.3f  %-14s", (rec->time_ns - start_ns) / 1e9,
+	       prev_ns ? (double)(int64_t)(rec->time_ns - prev_ns) / 1e3 : 0.0,
+	       name);
+
+	switch (rec->event) {
+	case TINYTRACE_WRITE:
+	case TINYTRACE_READ:
+		printf(" bytes=%llu", (unsigned long long)rec->value);
+		break;
+	case TINYTRACE_WRITEV:
+		printf(" iovcnt=%llu", (unsigned long long)rec->value);
+		break;
+	case TINYTRACE_AVAIL:
+		printf(" avail=%llu", (unsigned long long)rec->value);
+		break;
+	case TINYTRACE_DRAIN:
+	case TINYTRACE_PARTIAL_DRAIN:
+		printf(" took=%.3fms", rec->value / 1e6);
+		break;
+	case TINYTRACE_POLL:
+		printf(" timeout=%d revents=0x%x", (int)(rec->value >> 32),
+		       (unsigned int)(rec->value & 0xffff));
+		break;
+	default:
+		break;
+	}
+	printf(" ret=%d\n", rec->result);
+}
+
+int main(int argc, char **argv)
+{
+	struct tinytrace_header hdr;
+	struct tinytrace_record rec;
+	uint64_t prev_ns = 0;
+	unsigned int i, errors_only = 0;
+	char pad[256];
+	int c, swap = 0;
+	FILE *file;
+
+	while ((c = getopt(argc, argv, "eh")) != -1) {
+		switch (c) {
+		case 'e':
+			errors_only = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	file = fopen(argv[optind], "rb");
+	if (!file) {
+		fprintf(stderr, "cannot open %s: %s\n", argv[optind],
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1)
+		goto bad;
+	if (hdr.magic == __builtin_bswap32(TINYTRACE_MAGIC)) {
+		swap = 1;
+		swap_header(&hdr);
+	}
+	if (hdr.magic != TINYTRACE_MAGIC || hdr.version != TINYTRACE_VERSION ||
+	    hdr.record_size < sizeof(rec) ||
+	    hdr.record_size - sizeof(rec) > sizeof(pad))
+		goto bad;
+
+	printf("%u of %llu events\n", hdr.count, (unsigned long long)hdr.total);
+	printf("%12s %10s  %-14s\n", "time s", "delta us", "event");
+
+	for (i = 0; i < hdr.count; i++) {
+		/* newer writers may append fields to a record */
+		if (fread(&rec, sizeof(rec), 1, file) != 1 ||
+		    (hdr.record_size > sizeof(rec) &&
+		     fread(pad, hdr.record_size - sizeof(rec), 1, file) != 1)) {
+			fprintf(stderr, "dump truncated after %u events\n", i);
+			break;
+		}
+		if (swap)
+			swap_record(&rec);
+		if (!errors_only || rec.result < 0)
+			print_record(&rec, hdr.start_ns, prev_ns);
+		prev_ns = rec.time_ns;
+	}
+
+	fclose(file);
+	return EXIT_SUCCESS;
+
+bad:
+	fprintf(stderr, "%s is not a tinycompress trace\n", argv[optind]);
+	fclose(file);
+	return EXIT_FAILURE;
+}
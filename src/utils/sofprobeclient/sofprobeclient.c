@@ -192,7 +192,7 @@ static void capture_and_parse(unsigned int card, unsigned int device,
 		fprintf(finfo, "%s: Opened compress device\n", __func__);
 
 	size = config.fragments * config.fragment_size;
-	buffer = malloc(size);
+	buffer = compress_alloc_buffer(compress, COMPRESS_BUFFER_MLOCK);
 	if (!buffer) {
 		fprintf(stderr, "Unable to allocate %d bytes\n", size);
 		goto comp_exit;
@@ -265,12 +265,12 @@ static void capture_and_parse(unsigned int card, unsigned int device,
 	if (verbose)
 		fprintf(finfo, "%s: exit success\n", __func__);
 
-	free(buffer);
+	compress_free_buffer(buffer);
 	compress_close(compress);
 
 	return;
 buf_exit:
-	free(buffer);
+	compress_free_buffer(buffer);
 comp_exit:
 	compress_close(compress);
 